@@ -0,0 +1,16 @@
+#!/bin/sh
+# Builds main.cpp and main.rs with optimizations, runs both with --bench-table
+# and prints the rows as one table, grouped by objective, eps and batch size.
+set -e
+cd "$(dirname "$0")"
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+g++ -std=c++17 -O2 -pthread main.cpp -o "$out/main_cpp"
+rustc -O main.rs -o "$out/main_rs"
+
+{ "$out/main_cpp" --bench-table; "$out/main_rs" --bench-table; } |
+	sort -t "$(printf '\t')" -k2,2 -k3,3 -k4,4n -k1,1 |
+	awk -F '\t' '
+		BEGIN { printf "%-5s %-10s %-6s %6s %11s %12s %12s %14s\n", "lang", "objective", "eps", "batch", "iterations", "evaluations", "total ms", "ns/evaluation" }
+		{ printf "%-5s %-10s %-6s %6d %11d %12d %12.4f %14.3f\n", $1, $2, $3, $4, $5, $6, $7, $8 }'
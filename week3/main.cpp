@@ -1,6 +1,16 @@
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
-double f(double x)
+constexpr double f(double x)
 {
 	double xx = x * x;
 	double xxx = xx * x;
@@ -8,20 +18,167 @@ double f(double x)
 	return 1 + 4 * x + 6 * xx + 4 * xxx + xxxx;
 }
 
-double TernarySearch(double (&funcRef)(double),
-										 double left,
-										 double right,
-										 double eps=1e-10,
-										 int maxIterations=1e6,
-										 bool log=false)
+// Per-run numbers reported by the searches when a stats pointer is passed.
+struct SearchStats
 {
 	int iterations = 0;
+	int evaluations = 0;
+	double bracketWidth = 0;
+	double seconds = 0;
+};
+
+// Times one search run for its SearchStats: the clock starts when the scope
+// is created at the top of the search, Finish fills in the stats. Without a
+// stats pointer it does nothing, so the searches still run at compile time.
+class SearchStatsScope
+{
+public:
+	constexpr explicit SearchStatsScope(SearchStats *stats) : stats(stats)
+	{
+		if (stats)
+		{
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	constexpr void Finish(int iterations, int evaluations, double bracketWidth) const
+	{
+		if (stats)
+		{
+			stats->iterations = iterations;
+			stats->evaluations = evaluations;
+			stats->bracketWidth = bracketWidth;
+			stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+private:
+	SearchStats *stats;
+	std::chrono::steady_clock::time_point start{};
+};
+
+// Opt-in per-iteration record of a search: the bracket width the probes were
+// placed in, both probe values and the time since the search started. The
+// buffer is allocated up front and Record() does no I/O; iterations beyond
+// the capacity are counted as dropped. Export with WriteCsv / WriteJson.
+class SearchTrace
+{
+public:
+	struct Entry
+	{
+		int iteration;
+		double bracketWidth;
+		double leftValue;
+		double rightValue;
+		long long nanoseconds;
+	};
+
+	explicit SearchTrace(int capacity) : entries(capacity > 0 ? capacity : 0)
+	{
+	}
+
+	void Start()
+	{
+		size = 0;
+		dropped = 0;
+		start = std::chrono::steady_clock::now();
+	}
+
+	void Record(int iteration, double bracketWidth, double leftValue, double rightValue)
+	{
+		if (size == static_cast<int>(entries.size()))
+		{
+			++dropped;
+			return;
+		}
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		entries[size++] = {iteration, bracketWidth, leftValue, rightValue,
+											 std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()};
+	}
+
+	int Size() const
+	{
+		return size;
+	}
+
+	int Dropped() const
+	{
+		return dropped;
+	}
+
+	const Entry &operator[](int i) const
+	{
+		return entries[i];
+	}
+
+	void WriteCsv(std::ostream &to) const
+	{
+		to << "iteration,bracket_width,left_value,right_value,ns\n";
+		to << std::setprecision(17);
+		for (int i = 0; i < size; ++i)
+		{
+			const Entry &e = entries[i];
+			to << e.iteration << ',' << e.bracketWidth << ',' << e.leftValue << ','
+				 << e.rightValue << ',' << e.nanoseconds << '\n';
+		}
+	}
+
+	void WriteJson(std::ostream &to) const
+	{
+		to << std::setprecision(17);
+		to << "{\"dropped\": " << dropped << ", \"iterations\": [";
+		for (int i = 0; i < size; ++i)
+		{
+			const Entry &e = entries[i];
+			to << (i ? ", " : "") << "{\"iteration\": " << e.iteration
+				 << ", \"bracket_width\": " << e.bracketWidth
+				 << ", \"left_value\": " << e.leftValue
+				 << ", \"right_value\": " << e.rightValue
+				 << ", \"ns\": " << e.nanoseconds << "}";
+		}
+		to << "]}\n";
+	}
+
+private:
+	std::vector<Entry> entries;
+	int size = 0;
+	int dropped = 0;
+	std::chrono::steady_clock::time_point start;
+};
+
+// func may be a function, lambda or functor. With a constexpr objective and
+// log=false the search can run at compile time.
+template<typename Func>
+constexpr double TernarySearch(Func &&func,
+															 double left,
+															 double right,
+															 double eps=1e-10,
+															 int maxIterations=1e6,
+															 bool log=false,
+															 SearchStats *stats=nullptr,
+															 SearchTrace *trace=nullptr)
+{
+	SearchStatsScope statsScope(stats);
+	if (trace)
+	{
+		trace->Start();
+	}
+
+	int iterations = 0;
+	int evaluations = 0;
 	while (right - left > eps && iterations < maxIterations)
 	{
 		double ml = left * 2 / 3 + right / 3;
 		double mr = left / 3 + right * 2 / 3;
 
-		if (funcRef(ml) < funcRef(mr))
+		double fl = func(ml);
+		double fr = func(mr);
+		if (trace)
+		{
+			trace->Record(iterations, right - left, fl, fr);
+		}
+
+		if (fl < fr)
 		{
 			right = mr;
 		}
@@ -29,21 +186,881 @@ double TernarySearch(double (&funcRef)(double),
 		{
 			left = ml;
 		}
+		evaluations += 2;
 		++iterations;
 	}
 
 	if (log)
 	{
-		std::cout << "TernarySearch iterations: " << iterations << std::endl << std::flush;
+		std::cout << "TernarySearch iterations: " << iterations
+							<< ", evaluations: " << evaluations << std::endl << std::flush;
 	}
 
+	statsScope.Finish(iterations, evaluations, right - left);
+
 	return (left + right) / 2;
 }
 
+// Same contract as TernarySearch, but probes are placed at golden ratio points,
+// so one of them is reused on the next iteration: one objective call per step
+// and the bracket shrinks by 0.618 instead of 0.667.
+template<typename Func>
+constexpr double GoldenSectionSearch(Func &&func,
+																		 double left,
+																		 double right,
+																		 double eps=1e-10,
+																		 int maxIterations=1e6,
+																		 bool log=false,
+																		 SearchStats *stats=nullptr,
+																		 SearchTrace *trace=nullptr)
+{
+	SearchStatsScope statsScope(stats);
+	if (trace)
+	{
+		trace->Start();
+	}
+
+	const double invPhi = 0.6180339887498949; // (sqrt(5) - 1) / 2
+
+	int iterations = 0;
+	int evaluations = 0;
+	double ml = right - invPhi * (right - left);
+	double mr = left + invPhi * (right - left);
+	double fl = 0;
+	double fr = 0;
+	if (right - left > eps && maxIterations > 0)
+	{
+		fl = func(ml);
+		fr = func(mr);
+		evaluations += 2;
+	}
+
+	while (right - left > eps && iterations < maxIterations)
+	{
+		if (trace)
+		{
+			trace->Record(iterations, right - left, fl, fr);
+		}
+
+		if (fl < fr)
+		{
+			right = mr;
+			mr = ml;
+			fr = fl;
+			ml = right - invPhi * (right - left);
+			fl = func(ml);
+		}
+		else
+		{
+			left = ml;
+			ml = mr;
+			fl = fr;
+			mr = left + invPhi * (right - left);
+			fr = func(mr);
+		}
+		++evaluations;
+		++iterations;
+	}
+
+	if (log)
+	{
+		std::cout << "GoldenSectionSearch iterations: " << iterations
+							<< ", evaluations: " << evaluations << std::endl << std::flush;
+	}
+
+	statsScope.Finish(iterations, evaluations, right - left);
+
+	return (left + right) / 2;
+}
+
+// Brent's method: parabolic interpolation through the three best points,
+// with a golden-section step whenever the parabola is not trustworthy.
+// Converges superlinearly on smooth objectives. Returns the best point found;
+// the remaining bracket width is reported through stats.
+template<typename Func>
+double BrentSearch(Func &&func,
+									 double left,
+									 double right,
+									 double eps=1e-10,
+									 int maxIterations=1e6,
+									 bool log=false,
+									 SearchStats *stats=nullptr)
+{
+	SearchStatsScope statsScope(stats);
+
+	const double golden = 0.3819660112501051; // (3 - sqrt(5)) / 2
+	// relative precision of x below sqrt(machine epsilon) is not reachable
+	// near a smooth minimum, so it is always part of the tolerance
+	const double relativeTolerance = 1.4901161193847656e-08;
+
+	double x = left + golden * (right - left);
+	double w = x;
+	double v = x;
+	double fx = func(x);
+	double fw = fx;
+	double fv = fx;
+	double step = 0;
+	double previousStep = 0;
+
+	int iterations = 0;
+	int evaluations = 1;
+	while (iterations < maxIterations)
+	{
+		double middle = (left + right) / 2;
+		double tolerance = relativeTolerance * std::abs(x) + eps / 4;
+		if (std::abs(x - middle) <= 2 * tolerance - (right - left) / 2)
+		{
+			break;
+		}
+
+		bool useGolden = true;
+		if (std::abs(previousStep) > tolerance)
+		{
+			double r = (x - w) * (fx - fv);
+			double q = (x - v) * (fx - fw);
+			double p = (x - v) * q - (x - w) * r;
+			q = 2 * (q - r);
+			if (q > 0)
+			{
+				p = -p;
+			}
+			q = std::abs(q);
+			double stepBeforeLast = previousStep;
+			previousStep = step;
+			// accept the parabola only if it lands inside the bracket and moves
+			// less than half of the step before last
+			if (std::abs(p) < std::abs(q * stepBeforeLast / 2) && p > q * (left - x) && p < q * (right - x))
+			{
+				step = p / q;
+				double u = x + step;
+				if (u - left < 2 * tolerance || right - u < 2 * tolerance)
+				{
+					step = middle > x ? tolerance : -tolerance;
+				}
+				useGolden = false;
+			}
+		}
+		if (useGolden)
+		{
+			previousStep = x >= middle ? left - x : right - x;
+			step = golden * previousStep;
+		}
+
+		double u = std::abs(step) >= tolerance ? x + step : x + (step > 0 ? tolerance : -tolerance);
+		double fu = func(u);
+		++evaluations;
+
+		if (fu <= fx)
+		{
+			if (u >= x)
+			{
+				left = x;
+			}
+			else
+			{
+				right = x;
+			}
+			v = w;
+			fv = fw;
+			w = x;
+			fw = fx;
+			x = u;
+			fx = fu;
+		}
+		else
+		{
+			if (u < x)
+			{
+				left = u;
+			}
+			else
+			{
+				right = u;
+			}
+			if (fu <= fw || w == x)
+			{
+				v = w;
+				fv = fw;
+				w = u;
+				fw = fu;
+			}
+			else if (fu <= fv || v == x || v == w)
+			{
+				v = u;
+				fv = fu;
+			}
+		}
+		++iterations;
+	}
+
+	if (log)
+	{
+		std::cout << "BrentSearch iterations: " << iterations
+							<< ", evaluations: " << evaluations << std::endl << std::flush;
+	}
+
+	statsScope.Finish(iterations, evaluations, right - left);
+
+	return x;
+}
+
+// Runs independent TernarySearch brackets in lockstep. Bounds are passed as
+// separate left/right arrays (struct-of-arrays), brackets are processed in
+// groups of BatchLanes, and every lane of a group is evaluated on every
+// iteration with the update of converged lanes masked out, so the lane
+// loops have no branches and vectorize once func inlines. Converged and
+// padding lanes are still evaluated and counted; their results are
+// discarded.
+// func(index, x) is the objective of bracket index at x; pass a lambda or
+// functor so it inlines.
+const int BatchLanes = 8;
+
+template<typename Func>
+void TernarySearchBatch(Func &&func,
+												const double *left,
+												const double *right,
+												double *result,
+												int count,
+												double eps=1e-10,
+												int maxIterations=1e6,
+												bool log=false)
+{
+	long long evaluations = 0;
+	int maxLaneIterations = 0;
+	for (int first = 0; first < count; first += BatchLanes)
+	{
+		int lanes = count - first < BatchLanes ? count - first : BatchLanes;
+		double l[BatchLanes];
+		double r[BatchLanes];
+		int index[BatchLanes];
+		for (int lane = 0; lane < BatchLanes; ++lane)
+		{
+			// padding lanes get an empty bracket on the last real one, so the
+			// objective is only ever called with a valid index
+			index[lane] = first + (lane < lanes ? lane : lanes - 1);
+			l[lane] = lane < lanes ? left[first + lane] : 0;
+			r[lane] = lane < lanes ? right[first + lane] : 0;
+		}
+
+		int iterations = 0;
+		while (iterations < maxIterations)
+		{
+			int activeLanes = 0;
+			for (int lane = 0; lane < BatchLanes; ++lane)
+			{
+				activeLanes += r[lane] - l[lane] > eps;
+			}
+			if (activeLanes == 0)
+			{
+				break;
+			}
+
+			double ml[BatchLanes];
+			double mr[BatchLanes];
+			double fl[BatchLanes];
+			double fr[BatchLanes];
+			for (int lane = 0; lane < BatchLanes; ++lane)
+			{
+				ml[lane] = l[lane] * 2 / 3 + r[lane] / 3;
+				mr[lane] = l[lane] / 3 + r[lane] * 2 / 3;
+				fl[lane] = func(index[lane], ml[lane]);
+				fr[lane] = func(index[lane], mr[lane]);
+			}
+			for (int lane = 0; lane < BatchLanes; ++lane)
+			{
+				bool active = r[lane] - l[lane] > eps;
+				bool goLeft = fl[lane] < fr[lane];
+				double newLeft = active && !goLeft ? ml[lane] : l[lane];
+				double newRight = active && goLeft ? mr[lane] : r[lane];
+				l[lane] = newLeft;
+				r[lane] = newRight;
+			}
+			evaluations += 2 * BatchLanes;
+			++iterations;
+		}
+		maxLaneIterations = iterations > maxLaneIterations ? iterations : maxLaneIterations;
+
+		for (int lane = 0; lane < lanes; ++lane)
+		{
+			result[first + lane] = (l[lane] + r[lane]) / 2;
+		}
+	}
+
+	if (log)
+	{
+		std::cout << "TernarySearchBatch brackets: " << count
+							<< ", iterations: " << maxLaneIterations
+							<< ", evaluations: " << evaluations << std::endl << std::flush;
+	}
+}
+
+// Fixed set of worker threads. ParallelFor hands out task indices to the
+// workers and the calling thread and returns once every task has finished.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(int workerCount)
+	{
+		for (int i = 0; i < workerCount; ++i)
+		{
+			workers.emplace_back([this] { WorkerLoop(); });
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto &worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	// number of threads running tasks, including the caller
+	int Size() const
+	{
+		return static_cast<int>(workers.size()) + 1;
+	}
+
+	void ParallelFor(int count, const std::function<void(int)> &task)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		// a worker that woke up late for the previous batch may still be about
+		// to take an index; the new batch is published only once it has left
+		done.wait(lock, [this] { return active == 0; });
+		current = &task;
+		total = count;
+		remaining = count;
+		next = 0;
+		++generation;
+		lock.unlock();
+		wake.notify_all();
+		RunTasks();
+
+		lock.lock();
+		done.wait(lock, [this] { return remaining == 0 && active == 0; });
+	}
+
+private:
+	void RunTasks()
+	{
+		while (true)
+		{
+			int i = next.fetch_add(1);
+			if (i >= total)
+			{
+				return;
+			}
+			(*current)(i);
+			if (remaining.fetch_sub(1) == 1)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				done.notify_all();
+			}
+		}
+	}
+
+	void WorkerLoop()
+	{
+		long long seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return stop || generation != seen; });
+				if (stop)
+				{
+					return;
+				}
+				seen = generation;
+				++active;
+			}
+			RunTasks();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--active == 0)
+			{
+				done.notify_all();
+			}
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	bool stop = false;
+	long long generation = 0;
+	// workers inside RunTasks, guarded by mutex
+	int active = 0;
+	std::atomic<const std::function<void(int)> *> current{nullptr};
+	std::atomic<int> total{0};
+	std::atomic<int> remaining{0};
+	std::atomic<int> next{0};
+};
+
+// Splits the bracket into `sections` equal parts and evaluates the
+// sections - 1 interior points at once on the pool, then keeps the two parts
+// around the best point. Every iteration shrinks the bracket by 2 / sections,
+// so for expensive objectives it makes sense to pick sections = pool.Size() + 1.
+template<typename Func>
+double KSectionSearch(Func &&func,
+											double left,
+											double right,
+											int sections,
+											ThreadPool &pool,
+											double eps=1e-10,
+											int maxIterations=1e6,
+											bool log=false,
+											SearchStats *stats=nullptr)
+{
+	SearchStatsScope statsScope(stats);
+
+	if (sections < 3)
+	{
+		sections = 3;
+	}
+	std::vector<double> points(sections + 1);
+	std::vector<double> values(sections + 1);
+
+	int iterations = 0;
+	int evaluations = 0;
+	while (right - left > eps && iterations < maxIterations)
+	{
+		for (int i = 0; i <= sections; ++i)
+		{
+			points[i] = left + (right - left) * i / sections;
+		}
+		pool.ParallelFor(sections - 1, [&](int i) { values[i + 1] = func(points[i + 1]); });
+
+		int best = 1;
+		for (int i = 2; i < sections; ++i)
+		{
+			if (values[i] < values[best])
+			{
+				best = i;
+			}
+		}
+		left = points[best - 1];
+		right = points[best + 1];
+
+		evaluations += sections - 1;
+		++iterations;
+	}
+
+	if (log)
+	{
+		std::cout << "KSectionSearch sections: " << sections
+							<< ", iterations: " << iterations
+							<< ", evaluations: " << evaluations << std::endl << std::flush;
+	}
+
+	statsScope.Finish(iterations, evaluations, right - left);
+
+	return (left + right) / 2;
+}
+
+// Polynomial of a fixed degree, coefficients from the constant term up:
+// coefficients[0] + coefficients[1] * x + ... + coefficients[Degree] * x^Degree.
+// Coefficients may be compile-time constants or filled at runtime.
+template<int Degree>
+struct Polynomial
+{
+	double coefficients[Degree + 1] = {};
+
+	// Horner scheme; every step is a multiply-add, contracted into an FMA
+	// when the target has one (-mfma / -march=native)
+	constexpr double operator()(double x) const
+	{
+		double value = coefficients[Degree];
+		for (int i = Degree - 1; i >= 0; --i)
+		{
+			value = value * x + coefficients[i];
+		}
+		return value;
+	}
+
+	// Evaluates the polynomial at count points. The Horner loop is unrolled
+	// for the fixed degree, so the loop over points vectorizes.
+	void Evaluate(const double *x, double *values, int count) const
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			double value = coefficients[Degree];
+			for (int k = Degree - 1; k >= 0; --k)
+			{
+				value = value * x[i] + coefficients[k];
+			}
+			values[i] = value;
+		}
+	}
+
+	constexpr Polynomial<(Degree > 0 ? Degree - 1 : 0)> Derivative() const
+	{
+		Polynomial<(Degree > 0 ? Degree - 1 : 0)> derivative;
+		for (int i = 1; i <= Degree; ++i)
+		{
+			derivative.coefficients[i - 1] = i * coefficients[i];
+		}
+		return derivative;
+	}
+};
+
+// Writes the roots of p in [left, right] to roots (at most Degree of them)
+// in increasing order and returns their count. p is monotone between the
+// roots of its derivative, so every sign change found between them holds
+// exactly one root, refined by Newton steps guarded with bisection.
+// Leading coefficients may be zero; the zero polynomial has no isolated
+// roots and gives none.
+template<int Degree>
+constexpr int PolynomialRoots(const Polynomial<Degree> &p,
+															double left,
+															double right,
+															double *roots,
+															double eps=1e-15,
+															int maxIterations=100)
+{
+	if constexpr (Degree == 0)
+	{
+		return 0;
+	}
+	else
+	{
+		bool zero = true;
+		for (int i = 0; i <= Degree; ++i)
+		{
+			zero = zero && p.coefficients[i] == 0;
+		}
+		if (zero)
+		{
+			return 0;
+		}
+
+		auto derivative = p.Derivative();
+		double bounds[Degree + 1] = {};
+		bounds[0] = left;
+		int boundCount = 1 + PolynomialRoots(derivative, left, right, bounds + 1, eps, maxIterations);
+		bounds[boundCount++] = right;
+
+		int count = 0;
+		// count never passes Degree for a nonzero p; the bound keeps roots
+		// in its buffer whatever rounding does near multiple roots
+		for (int i = 0; i + 1 < boundCount && count < Degree; ++i)
+		{
+			double a = bounds[i];
+			double b = bounds[i + 1];
+			double fa = p(a);
+			double fb = p(b);
+			if (fa == 0)
+			{
+				if (count == 0 || roots[count - 1] != a)
+				{
+					roots[count++] = a;
+				}
+				continue;
+			}
+			if (fb == 0 || (fa < 0) == (fb < 0))
+			{
+				// a root at b is picked up as the left bound of the next segment
+				continue;
+			}
+
+			double x = (a + b) / 2;
+			for (int iteration = 0; iteration < maxIterations; ++iteration)
+			{
+				double fx = p(x);
+				if (fx == 0)
+				{
+					break;
+				}
+				if ((fx < 0) == (fa < 0))
+				{
+					a = x;
+				}
+				else
+				{
+					b = x;
+				}
+				double slope = derivative(x);
+				double next = slope != 0 ? x - fx / slope : a;
+				if (!(next > a && next < b))
+				{
+					next = (a + b) / 2;
+				}
+				double change = next > x ? next - x : x - next;
+				x = next;
+				if (change <= eps || b - a <= eps)
+				{
+					break;
+				}
+			}
+			roots[count++] = x;
+		}
+		if (count < Degree && p(right) == 0 && (count == 0 || roots[count - 1] != right))
+		{
+			roots[count++] = right;
+		}
+		return count;
+	}
+}
+
+// Minimum of p on [left, right]: the best of the bracket ends and the roots
+// of the derivative. The cost depends only on the degree, not on the bracket.
+template<int Degree>
+constexpr double PolynomialMinimize(const Polynomial<Degree> &p,
+																		double left,
+																		double right,
+																		double eps=1e-15,
+																		int maxIterations=100)
+{
+	double best = p(left) <= p(right) ? left : right;
+	if constexpr (Degree > 1)
+	{
+		double critical[Degree - 1] = {};
+		int count = PolynomialRoots(p.Derivative(), left, right, critical, eps, maxIterations);
+		for (int i = 0; i < count; ++i)
+		{
+			if (p(critical[i]) < p(best))
+			{
+				best = critical[i];
+			}
+		}
+	}
+	return best;
+}
+
+// Total time of run(i) for i in [0, repeats), in nanoseconds. Results go to
+// a volatile sink so the calls cannot be optimized away.
+template<typename Run>
+double TimeRepeated(int repeats, Run &&run)
+{
+	volatile double sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeats; ++i)
+	{
+		sink = sink + run(i);
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// Prints the average time of search(left) over repeats calls, each with a
+// slightly different left bound so no call can be reused.
+template<typename Search>
+void MeasureSearch(const char *name, int repeats, Search &&search)
+{
+	double ns = TimeRepeated(repeats, [&](int i) { return search(-2.0 - i * 1e-9); }) / repeats;
+	std::cout << name << ": " << ns << " ns/search" << std::endl;
+}
+
+// Compares the cost of a search whose objective is an opaque function
+// reference (what a separately compiled caller gets) with the same search
+// on a lambda the compiler can inline.
+void BenchmarkCallOverhead()
+{
+	const int repeats = 100000;
+	const double eps = 1e-12;
+	double (*volatile opaque)(double) = f;
+
+	MeasureSearch("TernarySearch by reference", repeats, [&](double left) {
+		return TernarySearch(*opaque, left, 2.0, eps);
+	});
+	MeasureSearch("TernarySearch inlined", repeats, [&](double left) {
+		return TernarySearch([](double x) { return f(x); }, left, 2.0, eps);
+	});
+	MeasureSearch("GoldenSectionSearch by reference", repeats, [&](double left) {
+		return GoldenSectionSearch(*opaque, left, 2.0, eps);
+	});
+	MeasureSearch("GoldenSectionSearch inlined", repeats, [&](double left) {
+		return GoldenSectionSearch([](double x) { return f(x); }, left, 2.0, eps);
+	});
+}
+
+// Minimizing the polynomial f through its derivative roots versus probing it
+// with the generic searches.
+void BenchmarkPolynomial()
+{
+	const int repeats = 100000;
+	const double eps = 1e-12;
+	constexpr Polynomial<4> quartic{{1, 4, 6, 4, 1}};
+
+	MeasureSearch("TernarySearch on Polynomial", repeats, [&](double left) {
+		return TernarySearch(quartic, left, 2.0, eps);
+	});
+	MeasureSearch("BrentSearch on Polynomial", repeats, [&](double left) {
+		return BrentSearch(quartic, left, 2.0, eps);
+	});
+	MeasureSearch("PolynomialMinimize", repeats, [&](double left) {
+		return PolynomialMinimize(quartic, left, 2.0, eps);
+	});
+}
+
+double Quadratic(double x)
+{
+	return (x - 0.3) * (x - 0.3) + 1;
+}
+
+double Cosine(double x)
+{
+	return std::cos(x);
+}
+
+// Prints one tab separated row per objective, tolerance and batch size:
+// lang, objective, eps, batch, iterations, evaluations, total ms, ns/evaluation.
+// main.rs --bench-table prints the same rows, bench.sh puts both in one table.
+void BenchmarkTable()
+{
+	struct Objective
+	{
+		const char *name;
+		double (*func)(double);
+		double left;
+		double right;
+	};
+	const Objective objectives[] = {
+		{"quartic", f, -2.0, 2.0},
+		{"quadratic", Quadratic, -2.0, 2.0},
+		{"cosine", Cosine, 2.0, 4.5},
+	};
+	const char *epsNames[] = {"1e-6", "1e-10", "1e-15"};
+	const double epsValues[] = {1e-6, 1e-10, 1e-15};
+	const int batches[] = {1, 100, 10000};
+	const int maxIterations = 1000;
+
+	for (const Objective &objective : objectives)
+	{
+		for (int e = 0; e < 3; ++e)
+		{
+			for (int batch : batches)
+			{
+				// iteration count from an untimed run, so the timed loop has no stats overhead
+				SearchStats stats;
+				TernarySearch(objective.func, objective.left, objective.right, epsValues[e], maxIterations, false, &stats);
+
+				double ns = TimeRepeated(batch, [&](int i) {
+					double shift = i * 1e-9;
+					return TernarySearch(objective.func, objective.left - shift, objective.right + shift,
+															 epsValues[e], maxIterations);
+				});
+				long long evaluations = static_cast<long long>(stats.evaluations) * batch;
+				std::cout << "cpp\t" << objective.name << '\t' << epsNames[e] << '\t' << batch << '\t'
+									<< stats.iterations << '\t' << evaluations << '\t' << ns / 1e6 << '\t'
+									<< ns / evaluations << std::endl;
+			}
+		}
+	}
+}
+
 int main(int argc, const char* argv[]) {
+	if (argc > 1 && std::string(argv[1]) == "--bench-table")
+	{
+		BenchmarkTable();
+		return 0;
+	}
+	if (argc > 2 && std::string(argv[1]) == "--trace")
+	{
+		SearchTrace trace(1000);
+		TernarySearch(f, -2.0, 2.0, 1e-15, 1e3, false, nullptr, &trace);
+		if (std::string(argv[2]) == "json")
+		{
+			trace.WriteJson(std::cout);
+		}
+		else
+		{
+			trace.WriteCsv(std::cout);
+		}
+		return 0;
+	}
+	if (argc > 1 && std::string(argv[1]) == "--bench")
+	{
+		BenchmarkCallOverhead();
+		BenchmarkPolynomial();
+		return 0;
+	}
+
 	double min = TernarySearch(f, -2.0, 2.0, 1e-15, 1e3, true);
 
 	std::cout << min << ", " << f(min) << std::endl;
 
+	double goldenMin = GoldenSectionSearch(f, -2.0, 2.0, 1e-15, 1e3, true);
+
+	std::cout << goldenMin << ", " << f(goldenMin) << std::endl;
+
+	const int channels = 20;
+	double lefts[channels];
+	double rights[channels];
+	double mins[channels];
+	for (int i = 0; i < channels; ++i)
+	{
+		lefts[i] = -2.0 - 0.1 * i;
+		rights[i] = 2.0 + 0.3 * i;
+	}
+	// channel i searches f shifted right by 0.05 * i
+	TernarySearchBatch([](int i, double x) { return f(x - 0.05 * i); }, lefts, rights, mins, channels, 1e-12, 1e3, true);
+
+	std::cout << mins[0] << ", " << mins[channels - 1] << std::endl;
+
+	int workerCount = static_cast<int>(std::thread::hardware_concurrency()) - 1;
+	ThreadPool pool(workerCount > 0 ? workerCount : 0);
+	int sections = pool.Size() + 1 > 3 ? pool.Size() + 1 : 3;
+	double kSectionMin = KSectionSearch(f, -2.0, 2.0, sections, pool, 1e-15, 1e3, true);
+
+	std::cout << kSectionMin << ", " << f(kSectionMin) << std::endl;
+
+	double brentMin = BrentSearch(f, -2.0, 2.0, 1e-15, 1e3, true);
+
+	std::cout << brentMin << ", " << f(brentMin) << std::endl;
+
+	// same objective through every engine, to pick one by numbers
+	auto report = [](const char *name, double min, const SearchStats &stats) {
+		std::cout << name << ": min " << min
+							<< ", iterations " << stats.iterations
+							<< ", evaluations " << stats.evaluations
+							<< ", bracket " << stats.bracketWidth
+							<< ", " << stats.seconds * 1e6 << " us" << std::endl;
+	};
+	auto quadratic = [](double x) { return (x - 0.3) * (x - 0.3) + 1; };
+	for (int smooth = 0; smooth < 2; ++smooth)
+	{
+		std::cout << (smooth ? "(x - 0.3)^2 + 1" : "f") << std::endl;
+		SearchStats stats;
+		double at = smooth ? TernarySearch(quadratic, -2.0, 2.0, 1e-10, 1e3, false, &stats)
+											 : TernarySearch(f, -2.0, 2.0, 1e-10, 1e3, false, &stats);
+		report("  TernarySearch", at, stats);
+		at = smooth ? GoldenSectionSearch(quadratic, -2.0, 2.0, 1e-10, 1e3, false, &stats)
+								: GoldenSectionSearch(f, -2.0, 2.0, 1e-10, 1e3, false, &stats);
+		report("  GoldenSectionSearch", at, stats);
+		at = smooth ? BrentSearch(quadratic, -2.0, 2.0, 1e-10, 1e3, false, &stats)
+								: BrentSearch(f, -2.0, 2.0, 1e-10, 1e3, false, &stats);
+		report("  BrentSearch", at, stats);
+	}
+
+	constexpr double compileTimeMin = TernarySearch(f, -2.0, 2.0, 1e-12, 1e3);
+	static_assert(compileTimeMin > -1.01 && compileTimeMin < -0.99, "f has its minimum at -1");
+
+	std::cout << "compile time: " << compileTimeMin << std::endl;
+
+	// f expanded as a Polynomial, minimized through the roots of f'
+	constexpr Polynomial<4> quartic{{1, 4, 6, 4, 1}};
+	constexpr double polynomialMin = PolynomialMinimize(quartic, -2.0, 2.0);
+	static_assert(polynomialMin == -1, "f' = 4 (1 + x)^3 has its root at -1");
+
+	std::cout << "PolynomialMinimize: " << polynomialMin << ", " << quartic(polynomialMin) << std::endl;
+
+	// runtime coefficients with zero leading terms: x^2 - x + 2 stored as a
+	// quartic, and a constant, whose derivatives vanish identically
+	Polynomial<4> storedQuadratic;
+	storedQuadratic.coefficients[0] = 2;
+	storedQuadratic.coefficients[1] = -1;
+	storedQuadratic.coefficients[2] = 1;
+	Polynomial<2> constant;
+	constant.coefficients[0] = 1;
+	std::cout << "PolynomialMinimize with zero leading terms: "
+						<< PolynomialMinimize(storedQuadratic, -2.0, 2.0) << ", "
+						<< PolynomialMinimize(constant, -1.0, 1.0) << std::endl;
+
 	return 0;
 }
@@ -1,3 +1,6 @@
+use std::hint::black_box;
+use std::time::Instant;
+
 fn f(x: f64) -> f64 {
 	let xx = x * x;
 	let xxx = xx * x;
@@ -5,6 +8,14 @@ fn f(x: f64) -> f64 {
 	1.0 + 4.0 * x + 6.0 * xx + 4.0 * xxx + xxxx
 }
 
+fn quadratic(x: f64) -> f64 {
+	(x - 0.3) * (x - 0.3) + 1.0
+}
+
+fn cosine(x: f64) -> f64 {
+	x.cos()
+}
+
 fn ternary_search(
 	func: fn(f64) -> f64,
 	left: f64,
@@ -32,7 +43,48 @@ fn ternary_search(
 	(r, func(r), iterations)
 }
 
+// Same rows as main.cpp --bench-table: lang, objective, eps, batch,
+// iterations, evaluations, total ms, ns/evaluation.
+fn bench_table() {
+	let objectives: [(&str, fn(f64) -> f64, f64, f64); 3] = [
+		("quartic", f, -2.0, 2.0),
+		("quadratic", quadratic, -2.0, 2.0),
+		("cosine", cosine, 2.0, 4.5),
+	];
+	let tolerances = [("1e-6", 1e-6), ("1e-10", 1e-10), ("1e-15", 1e-15)];
+	let batches = [1, 100, 10000];
+	let max_iterations = 1000;
+
+	for &(name, func, left, right) in objectives.iter() {
+		for &(eps_name, eps) in tolerances.iter() {
+			for &batch in batches.iter() {
+				let (_, _, iterations) = ternary_search(func, left, right, eps, max_iterations);
+
+				let start = Instant::now();
+				let mut sink = 0.0;
+				for i in 0..batch {
+					let shift = i as f64 * 1e-9;
+					let (min_at, _, _) = ternary_search(black_box(func), left - shift, right + shift, eps, max_iterations);
+					sink += min_at;
+				}
+				let ns = start.elapsed().as_nanos() as f64;
+				black_box(sink);
+
+				// two probes per iteration plus the value at the result
+				let evaluations = (2 * iterations as i64 + 1) * batch as i64;
+				println!("rust\t{}\t{}\t{}\t{}\t{}\t{}\t{}",
+					name, eps_name, batch, iterations, evaluations, ns / 1e6, ns / evaluations as f64);
+			}
+		}
+	}
+}
+
 fn main() {
+	if std::env::args().nth(1).as_deref() == Some("--bench-table") {
+		bench_table();
+		return;
+	}
+
 	let (min_at, min_val, iterations) = ternary_search(f, -2.0, 2.0, 1e-15, 1000);
 	// let (min_at, min_val, iterations) = ternary_search(|x: f64| -> f64 {x * x}, -2.0, 2.0, 1e-15, 1000);
 	println!("ternary_search iterations: {}", iterations);
@@ -1,17 +1,910 @@
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+// Widest vector the target has, used by the gemm micro-kernel
+// (GCC/Clang vector extensions, lowered to SSE/AVX/AVX-512 or scalar code).
+#if defined(__AVX512F__)
+const int gemmVectorBytes = 64;
+#elif defined(__AVX__)
+const int gemmVectorBytes = 32;
+#else
+const int gemmVectorBytes = 16;
+#endif
+
+// Register and cache blocking of the packed gemm kernel.
+// MR x NR is the block of C held in registers by the micro-kernel, a KC x NR
+// panel of B should stay in L1, an MC x KC block of A in L2, a KC x NC block of B in L3.
+template<typename T>
+struct GemmBlocking {
+  typedef T Vec __attribute__((vector_size(gemmVectorBytes)));
+  static constexpr int VL = gemmVectorBytes / sizeof(T);
+  static constexpr int MR = gemmVectorBytes == 16 ? 4 : 6;
+  static constexpr int NR = 2 * VL;
+  static constexpr int KC = 256;
+  static constexpr int MC = 96;
+  static constexpr int NC = 2048;
+};
+
+// float and double products below this many multiply-adds (and products of
+// any other type) are done by the plain triple loop
+const long long gemmThreshold = 48 * 48 * 48;
+
+// Copies an mc x kc block of A into MR-row slivers, column by column,
+// zero padding the last sliver.
+template<typename T>
+void gemmPackA(int mc, int kc, const T *a, int rsa, int csa, T *packed) {
+  const int MR = GemmBlocking<T>::MR;
+  for (int i0 = 0; i0 < mc; i0 += MR) {
+    for (int p = 0; p < kc; ++p) {
+      for (int i = 0; i < MR; ++i) {
+        *packed++ = i0 + i < mc ? a[(i0 + i) * rsa + p * csa] : 0;
+      }
+    }
+  }
+}
+
+// Copies a kc x nc block of B into NR-column slivers, row by row,
+// zero padding the last sliver.
+template<typename T>
+void gemmPackB(int kc, int nc, const T *b, int rsb, int csb, T *packed) {
+  const int NR = GemmBlocking<T>::NR;
+  for (int j0 = 0; j0 < nc; j0 += NR) {
+    for (int p = 0; p < kc; ++p) {
+      for (int j = 0; j < NR; ++j) {
+        *packed++ = j0 + j < nc ? b[p * rsb + (j0 + j) * csb] : 0;
+      }
+    }
+  }
+}
+
+// C[0:mr, 0:nr] += alpha * A sliver * B sliver. The MR x NR accumulator
+// block lives in vector registers; the loads go through memcpy because the
+// packed buffers are only aligned to T.
+template<typename T>
+inline void gemmMicroKernel(int kc, const T *__restrict a, const T *__restrict b,
+                            T *c, int rsc, int csc, T alpha, int mr, int nr) {
+  typedef GemmBlocking<T> B;
+  typedef typename B::Vec Vec;
+  const int NV = B::NR / B::VL;
+  Vec acc[B::MR][NV] = {};
+  for (int p = 0; p < kc; ++p) {
+    Vec bv[NV];
+    std::memcpy(bv, b, sizeof(bv));
+#pragma GCC unroll 8
+    for (int i = 0; i < B::MR; ++i) {
+#pragma GCC unroll 8
+      for (int j = 0; j < NV; ++j) {
+        acc[i][j] += a[i] * bv[j];
+      }
+    }
+    a += B::MR;
+    b += B::NR;
+  }
+  T out[B::MR][B::NR];
+  std::memcpy(out, acc, sizeof(out));
+  for (int i = 0; i < mr; ++i) {
+    for (int j = 0; j < nr; ++j) {
+      c[i * rsc + j * csc] += alpha * out[i][j];
+    }
+  }
+}
+
+// C (m x n) += alpha * A (m x k) * B (k x n).
+// Every operand is addressed through a row stride and a column stride, so
+// transposed and strided operands are multiplied without copying them first.
+template<typename T>
+void gemm(int m, int n, int k, T alpha,
+          const T *a, int rsa, int csa,
+          const T *b, int rsb, int csb,
+          T *c, int rsc, int csc) {
+  typedef GemmBlocking<T> B;
+  // slivers are zero padded up to MR rows / NR columns
+  std::vector<T> packedA((std::min(B::MC, m) + B::MR) * std::min(B::KC, k));
+  std::vector<T> packedB((std::min(B::NC, n) + B::NR) * std::min(B::KC, k));
+  for (int jc = 0; jc < n; jc += B::NC) {
+    int nc = std::min(B::NC, n - jc);
+    for (int pc = 0; pc < k; pc += B::KC) {
+      int kc = std::min(B::KC, k - pc);
+      gemmPackB(kc, nc, b + pc * rsb + jc * csb, rsb, csb, packedB.data());
+      for (int ic = 0; ic < m; ic += B::MC) {
+        int mc = std::min(B::MC, m - ic);
+        gemmPackA(mc, kc, a + ic * rsa + pc * csa, rsa, csa, packedA.data());
+        for (int jr = 0; jr < nc; jr += B::NR) {
+          for (int ir = 0; ir < mc; ir += B::MR) {
+            gemmMicroKernel(kc, packedA.data() + ir * kc, packedB.data() + jr * kc,
+                            c + (ic + ir) * rsc + (jc + jr) * csc, rsc, csc, alpha,
+                            std::min(B::MR, mc - ir), std::min(B::NR, nc - jr));
+          }
+        }
+      }
+    }
+  }
+}
+
+// gemm() for float and double, a plain loop nest for other element types
+template<typename T>
+void gemmAny(int m, int n, int k, T alpha,
+             const T *a, int rsa, int csa,
+             const T *b, int rsb, int csb,
+             T *c, int rsc, int csc) {
+  if constexpr (std::is_same<T, float>::value || std::is_same<T, double>::value) {
+    gemm(m, n, k, alpha, a, rsa, csa, b, rsb, csb, c, rsc, csc);
+  } else {
+    for (int i = 0; i < m; ++i) {
+      for (int j = 0; j < n; ++j) {
+        T val = 0;
+        for (int p = 0; p < k; ++p) {
+          val += a[i * rsa + p * csa] * b[p * rsb + j * csb];
+        }
+        c[i * rsc + j * csc] += alpha * val;
+      }
+    }
+  }
+}
+
+// Worker threads kept across parallelFor calls, so that a call does not
+// start and join threads of its own. One batch runs at a time: a call made
+// while another batch runs, or from inside a task, runs on the calling
+// thread alone. Workers join a batch only while it still has room for them
+// (helpers), and the caller closes it and waits for the ones inside before
+// it returns, so no worker ever sees the tasks of a batch that has ended.
+struct WorkerPool {
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  std::vector<std::thread> workers;
+  // held by the caller running a batch
+  std::mutex batch;
+  const std::function<void(int)> *task = nullptr;
+  int count = 0;
+  std::atomic<int> next{0};
+  // workers that may still join the current batch, and workers inside it
+  int helpers = 0, active = 0;
+  long long generation = 0;
+  bool stopping = false;
+
+  static inline thread_local bool inTask = false;
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  void run(int count, int threads, const std::function<void(int)> &task) {
+    std::unique_lock<std::mutex> owner(batch, std::defer_lock);
+    if (threads <= 1 || inTask || !owner.try_lock()) {
+      for (int i = 0; i < count; ++i) {
+        task(i);
+      }
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    while ((int) workers.size() < threads - 1) {
+      workers.emplace_back([this] { work(); });
+    }
+    this->task = &task;
+    this->count = count;
+    next = 0;
+    helpers = threads - 1;
+    ++generation;
+    lock.unlock();
+    wake.notify_all();
+    take();
+    lock.lock();
+    helpers = 0;
+    done.wait(lock, [this] { return active == 0; });
+  }
+
+  void work() {
+    long long seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [&] { return stopping || (generation != seen && helpers > 0); });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+      --helpers;
+      ++active;
+      lock.unlock();
+      take();
+      lock.lock();
+      if (--active == 0) {
+        done.notify_all();
+      }
+    }
+  }
+
+  // takes the next free index until none is left
+  void take() {
+    inTask = true;
+    for (int i = next++; i < count; i = next++) {
+      (*task)(i);
+    }
+    inTask = false;
+  }
+};
+
+inline WorkerPool &workerPool() {
+  static WorkerPool pool;
+  return pool;
+}
+
+// Runs task(i) for i in [0, count) on `threads` threads, the caller included.
+// Threads take the next free index, so uneven tasks still balance.
+inline void parallelFor(int count, int threads, const std::function<void(int)> &task) {
+  workerPool().run(count, std::max(1, std::min(threads, count)), task);
+}
+
+inline int defaultThreads() {
+  return std::max(1, (int) std::thread::hardware_concurrency());
+}
+
+// The parallel gemm splits the output into at least this many tiles per
+// thread, so that threads finishing early still find work. Each tile is
+// computed by one thread in the same order as the serial kernel, so the
+// result does not depend on the thread count.
+const int gemmTilesPerThread = 4;
+// products below this many multiply-adds are not worth starting threads for
+const long long parallelGemmThreshold = 128 * 128 * 128;
+
+// gemm() with the output split into tiles spread across threads. Tiles are
+// about MC rows high and are cut into columns when the rows alone do not
+// give gemmTilesPerThread tiles per thread.
+template<typename T>
+void parallelGemm(int threads, int m, int n, int k, T alpha,
+                  const T *a, int rsa, int csa,
+                  const T *b, int rsb, int csb,
+                  T *c, int rsc, int csc) {
+  if (threads <= 1 || (long long) m * n * k < parallelGemmThreshold) {
+    gemm(m, n, k, alpha, a, rsa, csa, b, rsb, csb, c, rsc, csc);
+    return;
+  }
+  const int MR = GemmBlocking<T>::MR, NR = GemmBlocking<T>::NR, MC = GemmBlocking<T>::MC;
+  int wanted = gemmTilesPerThread * threads;
+  int rowSplits = std::min((m + MC - 1) / MC, wanted);
+  int colSplits = (wanted + rowSplits - 1) / rowSplits;
+  int tileRows = ((m + rowSplits - 1) / rowSplits + MR - 1) / MR * MR;
+  int tileCols = std::max(NR, ((n + colSplits - 1) / colSplits + NR - 1) / NR * NR);
+  int rowTiles = (m + tileRows - 1) / tileRows;
+  int colTiles = (n + tileCols - 1) / tileCols;
+  parallelFor(rowTiles * colTiles, threads, [&](int tile) {
+    int i0 = tile / colTiles * tileRows;
+    int j0 = tile % colTiles * tileCols;
+    gemm(std::min(tileRows, m - i0), std::min(tileCols, n - j0), k, alpha,
+         a + i0 * rsa, rsa, csa,
+         b + j0 * csb, rsb, csb,
+         c + i0 * rsc + j0 * csc, rsc, csc);
+  });
+}
+
+// square float/double matrices from this size on are factored by blocks
+const int luBlockThreshold = 256;
+const int luBlockSize = 64;
+
+template<typename MatType>
+struct LU;
+
+template<typename Expr, typename MatType>
+struct MatExpr;
+template<typename MatType>
+struct MatRef;
+template<typename Left, typename Right>
+struct MatSum;
+template<typename Inner, typename Func>
+struct MatMap;
+template<typename Inner>
+struct MatScale;
+template<typename Inner>
+struct MatTranspose;
+template<typename MatType>
+struct GemmOperand;
+template<typename MatType>
+struct MatView;
+
+// Mat buffers are 64-byte aligned and padded to whole cache lines, so
+// vector loads never split a line and a buffer never shares its last line
+// with another. They come from a pluggable allocator: matAllocator() points
+// at the one used for new buffers. A header in front of every buffer
+// remembers the allocator and the size, so a buffer always goes back where
+// it came from, even after the allocator is switched. The header holds a
+// plain pointer, so an allocator has to outlive every buffer it handed
+// out; MatPoolAllocator checks this when it is destroyed.
+const size_t matAlignment = 64;
+
+struct MatAllocator {
+  virtual ~MatAllocator() = default;
+  // bytes is a multiple of matAlignment, the result is aligned to it
+  virtual void *allocate(size_t bytes) = 0;
+  virtual void deallocate(void *p, size_t bytes) = 0;
+};
+
+struct MatHeapAllocator : MatAllocator {
+  void *allocate(size_t bytes) override {
+    return ::operator new(bytes, std::align_val_t(matAlignment));
+  }
+
+  void deallocate(void *p, size_t) override {
+    ::operator delete(p, std::align_val_t(matAlignment));
+  }
+};
+
+// Keeps freed buffers in per-size free lists, up to maxCachedBytes in
+// total, so temporaries of recurring shapes stop reaching malloc. hits and
+// misses count the allocations served from the lists and from the heap,
+// live the buffers handed out and not yet given back.
+struct MatPoolAllocator : MatAllocator {
+  std::mutex mutex;
+  std::unordered_map<size_t, std::vector<void *>> freeLists;
+  size_t cachedBytes = 0;
+  size_t maxCachedBytes;
+  std::atomic<long long> hits{0}, misses{0}, live{0};
+  MatHeapAllocator heap;
+
+  explicit MatPoolAllocator(size_t maxCachedBytes=size_t(256) << 20) : maxCachedBytes(maxCachedBytes) {}
+
+  // a matrix still holding a buffer of this pool would free it into a
+  // destroyed allocator later
+  ~MatPoolAllocator() override {
+    assert(live == 0 && "a MatPoolAllocator must outlive the matrices it allocated");
+    trim();
+  }
+
+  void *allocate(size_t bytes) override {
+    ++live;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto list = freeLists.find(bytes);
+      if (list != freeLists.end() && !list->second.empty()) {
+        void *p = list->second.back();
+        list->second.pop_back();
+        cachedBytes -= bytes;
+        ++hits;
+        return p;
+      }
+    }
+    ++misses;
+    return heap.allocate(bytes);
+  }
+
+  void deallocate(void *p, size_t bytes) override {
+    --live;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (cachedBytes + bytes <= maxCachedBytes) {
+        freeLists[bytes].push_back(p);
+        cachedBytes += bytes;
+        return;
+      }
+    }
+    heap.deallocate(p, bytes);
+  }
+
+  // returns every cached buffer to the heap
+  void trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &list : freeLists) {
+      for (void *p : list.second) {
+        heap.deallocate(p, list.first);
+      }
+    }
+    freeLists.clear();
+    cachedBytes = 0;
+  }
+};
+
+// switched with a store or exchange, which other threads see atomically
+inline std::atomic<MatAllocator *> &matAllocator() {
+  static MatHeapAllocator heap;
+  static std::atomic<MatAllocator *> current{&heap};
+  return current;
+}
+
+struct MatBufferHeader {
+  MatAllocator *allocator;
+  size_t bytes;
+};
+
+// Reference count of a buffer shared by copy-on-write matrices, see
+// Mat::cow(). release frees the buffer once the last matrix lets go of it.
+// A read-only buffer, such as a mapped file, is copied before any write
+// even when a single matrix holds it.
+struct MatShared {
+  std::atomic<int> refs{1};
+  std::function<void()> release;
+  bool readOnly;
+
+  explicit MatShared(std::function<void()> release, bool readOnly=false)
+      : release(std::move(release)), readOnly(readOnly) {}
+};
+
+// Binary matrix file: a 64-byte MatFileHeader, then rows * cols elements in
+// the header's layout and in native byte order. The header size keeps the
+// data 64-byte aligned when the file is mapped. saveMat writes it, loadMat
+// reads it into memory, and mapMat maps it with no parse or copy step.
+enum class MatLayout : uint32_t {
+  RowMajor = 0,
+  ColMajor = 1,
+};
+
+const char matFileMagic[8] = {'s', 't', 'z', 'm', 'a', 't', '\0', '\0'};
+const uint32_t matFileVersion = 1;
+// written as is, so a file from a machine of the other byte order reads back swapped
+const uint32_t matFileByteOrder = 0x01020304;
+
+struct MatFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t dtype;
+  uint32_t elementSize;
+  uint32_t layout;
+  uint32_t reserved;
+  uint64_t rows, cols;
+  char padding[16];
+};
+
+static_assert(sizeof(MatFileHeader) == 64, "the data must start 64 bytes into the file");
+
+// element type codes of the header
+template<typename MatType>
+constexpr uint32_t matDtype() {
+  if constexpr (std::is_same<MatType, float>::value) {
+    return 1;
+  } else if constexpr (std::is_same<MatType, double>::value) {
+    return 2;
+  } else if constexpr (std::is_same<MatType, int32_t>::value) {
+    return 3;
+  } else if constexpr (std::is_same<MatType, int64_t>::value) {
+    return 4;
+  } else {
+    static_assert(sizeof(MatType) == 0, "no file dtype for this element type");
+    return 0;
+  }
+}
+
+// throws std::runtime_error unless header describes a matrix of MatType
+// whose data fits in dataBytes
 template<typename MatType>
+void checkMatFileHeader(const MatFileHeader &header, uint64_t dataBytes, const std::string &name) {
+  if (std::memcmp(header.magic, matFileMagic, sizeof(matFileMagic)) != 0) {
+    throw std::runtime_error(name + ": not a matrix file");
+  }
+  if (header.byteOrder != matFileByteOrder) {
+    throw std::runtime_error(name + ": written with the other byte order");
+  }
+  if (header.version != matFileVersion) {
+    throw std::runtime_error(name + ": unsupported version " + std::to_string(header.version));
+  }
+  if (header.dtype != matDtype<MatType>() || header.elementSize != sizeof(MatType)) {
+    throw std::runtime_error(name + ": element type " + std::to_string(header.dtype) + " does not match "
+                             + std::to_string(matDtype<MatType>()));
+  }
+  if (header.layout != (uint32_t) MatLayout::RowMajor && header.layout != (uint32_t) MatLayout::ColMajor) {
+    throw std::runtime_error(name + ": unknown layout " + std::to_string(header.layout));
+  }
+  if (header.rows > INT32_MAX || header.cols > INT32_MAX || header.rows * header.cols > INT32_MAX) {
+    throw std::runtime_error(name + ": " + std::to_string(header.rows) + "x" + std::to_string(header.cols)
+                             + " is too large for Mat");
+  }
+  if (header.rows * header.cols * sizeof(MatType) > dataBytes) {
+    throw std::runtime_error(name + ": truncated");
+  }
+}
+
+// default preprocessor of the Mat searches
+struct MatIdentity {
+  template<typename T>
+  T operator()(T x) const {
+    return x;
+  }
+};
+
+// Mat<T> has its size chosen at run time and its values on the heap.
+// Mat<T, R, C> is an R x C matrix with both known at compile time: values
+// live inline, loops have constant trip counts and unroll, and 2x2 to 4x4
+// inverses and determinants are closed form. It has the same API as far as
+// it makes sense for a fixed size, and everything but printing and the
+// nan/inf checks is constexpr.
+const int Dynamic = -1;
+
+template<typename MatType, int R=Dynamic, int C=Dynamic>
+struct Mat;
+
+template<typename MatType, int R, int C>
 struct Mat {
+  static_assert(R > 0 && C > 0, "use Mat<T> for run-time sizes");
+  static constexpr int rows = R;
+  static constexpr int cols = C;
+  MatType values[R * C] = {};
+
+  constexpr Mat() = default;
+
+  constexpr Mat(const MatType (&array)[R][C]) {
+    for (int i = 0; i < R; ++i) {
+      for (int j = 0; j < C; ++j) {
+        set(i, j, array[i][j]);
+      }
+    }
+  }
+
+  // the size must match, checked by an assert
+  explicit Mat(const Mat<MatType> &from) {
+    assert(from.rows == R && from.cols == C && "the dynamic matrix must be R x C");
+    std::copy(from.values, from.values + R * C, values);
+  }
+
+  static constexpr Mat eye() {
+    static_assert(R == C, "eye() is square");
+    Mat ret;
+    for (int i = 0; i < R; ++i) {
+      ret.set(i, i, 1);
+    }
+    return ret;
+  }
+
+  static constexpr Mat zeros() {
+    return Mat();
+  }
+
+  Mat<MatType> toDynamic() const {
+    Mat<MatType> ret(R, C);
+    std::copy(values, values + R * C, ret.values);
+    return ret;
+  }
+
+  constexpr MatType get(int r, int c) const {
+    return values[c + r * C];
+  }
+
+  constexpr MatType get(int idx) const {
+    return values[idx];
+  }
+
+  constexpr MatType set(int r, int c, MatType val) {
+    values[c + r * C] = val;
+    return val;
+  }
+
+  constexpr MatType set(int idx, MatType val) {
+    values[idx] = val;
+    return val;
+  }
+
+  template<typename Func>
+  constexpr void _map(Func mapper) {
+#pragma GCC unroll 16
+    for (int i = 0; i < R * C; ++i) {
+      values[i] = mapper(values[i]);
+    }
+  }
+
+  template<typename Func>
+  constexpr Mat map(Func mapper) const {
+    Mat copy(*this);
+    copy._map(mapper);
+    return copy;
+  }
+
+  constexpr void _add(const Mat &other) {
+#pragma GCC unroll 16
+    for (int i = 0; i < R * C; ++i) {
+      values[i] += other.values[i];
+    }
+  }
+
+  constexpr Mat add(const Mat &other) const {
+    Mat copy(*this);
+    copy._add(other);
+    return copy;
+  }
+
+  template<int K>
+  constexpr Mat<MatType, R, K> mul(const Mat<MatType, C, K> &other) const {
+    Mat<MatType, R, K> ret;
+#pragma GCC unroll 16
+    for (int i = 0; i < R; ++i) {
+#pragma GCC unroll 16
+      for (int j = 0; j < K; ++j) {
+        MatType val{};
+#pragma GCC unroll 16
+        for (int k = 0; k < C; ++k) {
+          val += get(i, k) * other.get(k, j);
+        }
+        ret.set(i, j, val);
+      }
+    }
+    return ret;
+  }
+
+  // this^T * other
+  template<int K>
+  constexpr Mat<MatType, C, K> tmul(const Mat<MatType, R, K> &other) const {
+    return transpose().mul(other);
+  }
+
+  constexpr Mat<MatType, C, R> transpose() const {
+    Mat<MatType, C, R> ret;
+    for (int i = 0; i < R; ++i) {
+      for (int j = 0; j < C; ++j) {
+        ret.set(j, i, get(i, j));
+      }
+    }
+    return ret;
+  }
+
+  constexpr void _transpose() {
+    static_assert(R == C, "only a square matrix is transposed in place");
+    *this = transpose();
+  }
+
+  constexpr MatType det() const {
+    static_assert(R == C, "det() needs a square matrix");
+    const MatType *a = values;
+    if constexpr (R == 1) {
+      return a[0];
+    } else if constexpr (R == 2) {
+      return a[0] * a[3] - a[1] * a[2];
+    } else if constexpr (R == 3) {
+      return a[0] * (a[4] * a[8] - a[5] * a[7])
+           - a[1] * (a[3] * a[8] - a[5] * a[6])
+           + a[2] * (a[3] * a[7] - a[4] * a[6]);
+    } else if constexpr (R == 4) {
+      MatType s[6] = {}, c[6] = {};
+      _minors4(s, c);
+      return s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+    } else {
+      Mat copy(*this);
+      Mat<MatType, R, 1> dummy;
+      int swaps = copy._triangulate(dummy);
+      MatType ret = swaps % 2 ? -1 : 1;
+      for (int i = 0; i < R; ++i) {
+        ret *= copy.get(i, i);
+      }
+      return ret;
+    }
+  }
+
+  // adjugate over the determinant up to 4x4, Gauss-Jordan above that
+  constexpr Mat inv() const {
+    static_assert(R == C, "inv() needs a square matrix");
+    const MatType *a = values;
+    Mat ret;
+    MatType *b = ret.values;
+    if constexpr (R == 1) {
+      b[0] = 1 / a[0];
+    } else if constexpr (R == 2) {
+      MatType d = 1 / det();
+      b[0] = a[3] * d;
+      b[1] = -a[1] * d;
+      b[2] = -a[2] * d;
+      b[3] = a[0] * d;
+    } else if constexpr (R == 3) {
+      b[0] = a[4] * a[8] - a[5] * a[7];
+      b[1] = a[2] * a[7] - a[1] * a[8];
+      b[2] = a[1] * a[5] - a[2] * a[4];
+      b[3] = a[5] * a[6] - a[3] * a[8];
+      b[4] = a[0] * a[8] - a[2] * a[6];
+      b[5] = a[2] * a[3] - a[0] * a[5];
+      b[6] = a[3] * a[7] - a[4] * a[6];
+      b[7] = a[1] * a[6] - a[0] * a[7];
+      b[8] = a[0] * a[4] - a[1] * a[3];
+      MatType d = 1 / (a[0] * b[0] + a[1] * b[3] + a[2] * b[6]);
+      ret._map([d](MatType x) { return x * d; });
+    } else if constexpr (R == 4) {
+      MatType s[6] = {}, c[6] = {};
+      _minors4(s, c);
+      b[0] = a[5] * c[5] - a[6] * c[4] + a[7] * c[3];
+      b[1] = -a[1] * c[5] + a[2] * c[4] - a[3] * c[3];
+      b[2] = a[13] * s[5] - a[14] * s[4] + a[15] * s[3];
+      b[3] = -a[9] * s[5] + a[10] * s[4] - a[11] * s[3];
+      b[4] = -a[4] * c[5] + a[6] * c[2] - a[7] * c[1];
+      b[5] = a[0] * c[5] - a[2] * c[2] + a[3] * c[1];
+      b[6] = -a[12] * s[5] + a[14] * s[2] - a[15] * s[1];
+      b[7] = a[8] * s[5] - a[10] * s[2] + a[11] * s[1];
+      b[8] = a[4] * c[4] - a[5] * c[2] + a[7] * c[0];
+      b[9] = -a[0] * c[4] + a[1] * c[2] - a[3] * c[0];
+      b[10] = a[12] * s[4] - a[13] * s[2] + a[15] * s[0];
+      b[11] = -a[8] * s[4] + a[9] * s[2] - a[11] * s[0];
+      b[12] = -a[4] * c[3] + a[5] * c[1] - a[6] * c[0];
+      b[13] = a[0] * c[3] - a[1] * c[1] + a[2] * c[0];
+      b[14] = -a[12] * s[3] + a[13] * s[1] - a[14] * s[0];
+      b[15] = a[8] * s[3] - a[9] * s[1] + a[10] * s[0];
+      MatType d = 1 / (s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0]);
+      ret._map([d](MatType x) { return x * d; });
+    } else {
+      ret = eye();
+      Mat copy(*this);
+      copy._triangulate(ret);
+      for (int i = R - 1; i >= 0; --i) {
+        MatType pivot = copy.get(i, i);
+        for (int j = 0; j < R; ++j) {
+          MatType val = ret.get(i, j);
+          for (int k = i + 1; k < R; ++k) {
+            val -= copy.get(i, k) * ret.get(k, j);
+          }
+          ret.set(i, j, val / pivot);
+        }
+      }
+    }
+    return ret;
+  }
+
+  // x with A x = b for every column of b
+  template<int K>
+  constexpr Mat<MatType, R, K> solve(const Mat<MatType, R, K> &b) const {
+    return inv().mul(b);
+  }
+
+  // 2x2 minors of the top (s) and bottom (c) row pairs of a 4x4 matrix
+  constexpr void _minors4(MatType *s, MatType *c) const {
+    const MatType *a = values;
+    s[0] = a[0] * a[5] - a[4] * a[1];
+    s[1] = a[0] * a[6] - a[4] * a[2];
+    s[2] = a[0] * a[7] - a[4] * a[3];
+    s[3] = a[1] * a[6] - a[5] * a[2];
+    s[4] = a[1] * a[7] - a[5] * a[3];
+    s[5] = a[2] * a[7] - a[6] * a[3];
+    c[0] = a[8] * a[13] - a[12] * a[9];
+    c[1] = a[8] * a[14] - a[12] * a[10];
+    c[2] = a[8] * a[15] - a[12] * a[11];
+    c[3] = a[9] * a[14] - a[13] * a[10];
+    c[4] = a[9] * a[15] - a[13] * a[11];
+    c[5] = a[10] * a[15] - a[14] * a[11];
+  }
+
+  // forward elimination with partial pivoting, applied to attached as well;
+  // returns the number of row swaps
+  template<int K>
+  constexpr int _triangulate(Mat<MatType, R, K> &attached) {
+    int swaps = 0;
+    for (int col = 0; col < R; ++col) {
+      int pivot = col;
+      for (int i = col + 1; i < R; ++i) {
+        if (_abs(get(i, col)) > _abs(get(pivot, col))) {
+          pivot = i;
+        }
+      }
+      if (pivot != col) {
+        for (int j = 0; j < C; ++j) {
+          MatType tmp = get(col, j);
+          set(col, j, get(pivot, j));
+          set(pivot, j, tmp);
+        }
+        for (int j = 0; j < K; ++j) {
+          MatType tmp = attached.get(col, j);
+          attached.set(col, j, attached.get(pivot, j));
+          attached.set(pivot, j, tmp);
+        }
+        ++swaps;
+      }
+      MatType diag = get(col, col);
+      for (int i = col + 1; i < R; ++i) {
+        MatType multiplier = diag == 0 ? 0 : get(i, col) / diag;
+        for (int j = col; j < C; ++j) {
+          set(i, j, get(i, j) - multiplier * get(col, j));
+        }
+        for (int j = 0; j < K; ++j) {
+          attached.set(i, j, attached.get(i, j) - multiplier * attached.get(col, j));
+        }
+      }
+    }
+    return swaps;
+  }
+
+  // std::abs is not constexpr before C++23
+  static constexpr MatType _abs(MatType x) {
+    return x < 0 ? -x : x;
+  }
+
+  constexpr bool equals(const Mat &other) const {
+    for (int i = 0; i < R * C; ++i) {
+      if (values[i] != other.values[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool isnan() const {
+    for (int i = 0; i < R * C; ++i) {
+      if (std::isnan(values[i])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool isinf() const {
+    for (int i = 0; i < R * C; ++i) {
+      if (std::isinf(values[i])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void print(std::ostream &to, std::string name="") const {
+    toDynamic().print(to, name);
+  }
+};
+
+template<typename MatType>
+struct Mat<MatType, Dynamic, Dynamic> {
   int rows, cols;
   MatType *values;
 
+  // With copyOnWrite set, copies share the buffer instead of duplicating
+  // it, and a matrix gets a buffer of its own only when it is first written
+  // (set, the _ methods, a writable view). Copies inherit the flag. shared
+  // is set whenever copyOnWrite is, and null while the buffer has a single,
+  // plain owner.
+  bool copyOnWrite = false;
+  MatShared *shared = nullptr;
+  // set once view(), block(), row() or col() handed out a writable view of
+  // the buffer: writes through it bypass _detach, so such a buffer is never
+  // shared again and copies of the matrix get their own
+  bool viewed = false;
+
+  // buffers allocated by every Mat<MatType> so far
+  static inline std::atomic<long long> allocations{0};
+
+  static MatType *_allocate(int size) {
+    static_assert(std::is_trivially_destructible<MatType>::value, "Mat elements are never destroyed");
+    static_assert(alignof(MatType) <= matAlignment, "Mat elements must fit the buffer alignment");
+    ++allocations;
+    size_t bytes = matAlignment + (size * sizeof(MatType) + matAlignment - 1) / matAlignment * matAlignment;
+    MatAllocator *allocator = matAllocator();
+    char *base = static_cast<char *>(allocator->allocate(bytes));
+    new (base) MatBufferHeader{allocator, bytes};
+    return reinterpret_cast<MatType *>(base + matAlignment);
+  }
+
+  static void _free(MatType *buffer) {
+    if (!buffer) {
+      return;
+    }
+    char *base = reinterpret_cast<char *>(buffer) - matAlignment;
+    MatBufferHeader *header = reinterpret_cast<MatBufferHeader *>(base);
+    header->allocator->deallocate(base, header->bytes);
+  }
+
   template<int r, int c>
   Mat(MatType (&array)[r][c]) {
     this->rows = r;
     this->cols = c;
-    values = new MatType[rows * cols];
+    values = _allocate(rows * cols);
     for (int i = 0; i < r; ++i) {
       for (int j = 0; j < c; ++j) {
         set(i, j, array[i][j]);
@@ -19,349 +912,2511 @@ struct Mat {
     }
   }
 
-  Mat(Mat &from) {
-    this->rows = from.rows;
-    this->cols = from.cols;
-    values = new MatType[rows * cols];
-    for (int i = 0; i < from.rows * from.cols; ++i) {
-      set(i, from.get(i));
+  Mat(const Mat &from) {
+    this->rows = from.rows;
+    this->cols = from.cols;
+    if (from.copyOnWrite && !from.viewed) {
+      _share(from);
+      return;
+    }
+    values = _allocate(rows * cols);
+    std::copy(from.values, from.values + rows * cols, values);
+    if (from.copyOnWrite) {
+      copyOnWrite = true;
+      _countRefs();
+    }
+  }
+
+  // takes the buffer, from is left empty (0 x 0)
+  Mat(Mat &&from) noexcept
+      : rows(from.rows), cols(from.cols), values(from.values), copyOnWrite(from.copyOnWrite), shared(from.shared),
+        viewed(from.viewed) {
+    from.rows = 0;
+    from.cols = 0;
+    from.values = nullptr;
+    from.shared = nullptr;
+    from.viewed = false;
+  }
+
+  Mat(int rows, int cols) {
+    this->rows = rows;
+    this->cols = cols;
+    values = _allocate(rows * cols);
+  }
+
+  // a copy-on-write matrix over a buffer that shared owns, see mapMat
+  Mat(int rows, int cols, MatType *values, MatShared *shared)
+      : rows(rows), cols(cols), values(values), copyOnWrite(true), shared(shared) {}
+
+  // evaluates a lazy expression, see MatExpr
+  template<typename Expr>
+  Mat(const MatExpr<Expr, MatType> &expr) : Mat(expr.self().rows(), expr.self().cols()) {
+    expr.evalTo(values);
+  }
+
+  // copies the viewed entries
+  template<typename ViewType>
+  explicit Mat(const MatView<ViewType> &from) : Mat(from.rows, from.cols) {
+    _view()._assign(from);
+  }
+
+  // reuses the buffer when the sizes match and it is not shared
+  Mat &operator=(const Mat &from) {
+    if (this == &from) {
+      return *this;
+    }
+    if (from.copyOnWrite && !from.viewed) {
+      _release();
+      rows = from.rows;
+      cols = from.cols;
+      _share(from);
+      return *this;
+    }
+    if (shared || rows * cols != from.rows * from.cols) {
+      _release();
+      values = _allocate(from.rows * from.cols);
+    }
+    rows = from.rows;
+    cols = from.cols;
+    copyOnWrite = false;
+    std::copy(from.values, from.values + rows * cols, values);
+    if (from.copyOnWrite) {
+      cow();
+    }
+    return *this;
+  }
+
+  Mat &operator=(Mat &&from) noexcept {
+    std::swap(rows, from.rows);
+    std::swap(cols, from.cols);
+    std::swap(values, from.values);
+    std::swap(copyOnWrite, from.copyOnWrite);
+    std::swap(shared, from.shared);
+    std::swap(viewed, from.viewed);
+    return *this;
+  }
+
+  // turns copy-on-write on or off for later copies of this matrix. The
+  // count is set up here rather than on the first copy, so that copies,
+  // possibly made from several threads at once, only ever increment it.
+  Mat &cow(bool on=true) {
+    copyOnWrite = on;
+    if (on && !shared && values) {
+      _countRefs();
+    } else if (!on && shared && shared->refs == 1 && !shared->readOnly) {
+      delete shared;
+      shared = nullptr;
+    }
+    return *this;
+  }
+
+  // gives the plain buffer of a copy-on-write matrix its reference count
+  void _countRefs() {
+    MatType *buffer = values;
+    shared = new MatShared([buffer] { _free(buffer); });
+  }
+
+  // takes a reference to the buffer of from, this has none yet; a
+  // moved-from matrix has neither a buffer nor a count
+  void _share(const Mat &from) {
+    if (from.shared) {
+      ++from.shared->refs;
+    }
+    values = from.values;
+    shared = from.shared;
+    copyOnWrite = true;
+    viewed = false;
+  }
+
+  // called before every write: a buffer still shared with other matrices
+  // is copied first
+  void _detach() {
+    if (shared && (shared->refs > 1 || shared->readOnly)) {
+      MatType *own = _allocate(rows * cols);
+      std::copy(values, values + rows * cols, own);
+      _release();
+      values = own;
+      _countRefs();
+    }
+  }
+
+  void _release() {
+    if (shared) {
+      if (--shared->refs == 0) {
+        shared->release();
+        delete shared;
+      }
+      shared = nullptr;
+    } else {
+      _free(values);
+    }
+    values = nullptr;
+    viewed = false;
+  }
+
+  // evaluates straight into this buffer when the size fits and the
+  // expression does not read this matrix out of place
+  template<typename Expr>
+  Mat &operator=(const MatExpr<Expr, MatType> &expr) {
+    const Expr &e = expr.self();
+    if (shared || e.rows() * e.cols() != rows * cols || (!Expr::linear && e.refers(values))) {
+      return *this = Mat<MatType>(expr);
+    }
+    rows = e.rows();
+    cols = e.cols();
+    expr.evalTo(values);
+    return *this;
+  }
+
+  static Mat<MatType> eye(int n) {
+    Mat<MatType> ret(n, n);
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) {
+        ret.set(i, j, i == j ? 1 : 0);
+      }
+    }
+    return ret;
+  }
+
+  static Mat<MatType> eyeLike(const Mat<MatType> &like) {
+    Mat<MatType> ret(like.rows, like.cols);
+    for (int i = 0; i < like.rows; ++i) {
+      for (int j = 0; j < like.cols; ++j) {
+        ret.set(i, j, i == j ? 1 : 0);
+      }
+    }
+    return ret;
+  }
+
+  static Mat<MatType> zeros(int rows, int cols) {
+    Mat<MatType> ret(rows, cols);
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        ret.set(i, j, 0);
+      }
+    }
+    return ret;
+  }
+
+  static Mat<MatType> zerosLike(const Mat<MatType> &like) {
+    return zeros(like.rows, like.cols);
+  }
+
+  ~Mat() {
+    _release();
+  }
+
+  MatType get(int r, int c) const {
+    return *(values + c + r * cols);
+  }
+
+  MatType get(int idx) const {
+    return *(values + idx);
+  }
+
+  MatType set(int r, int c, MatType val) {
+    _detach();
+    *(values + c + r * cols) = val;
+    return val;
+  }
+
+  MatType set(int idx, MatType val) {
+    _detach();
+    *(values + idx) = val;
+    return val;
+  }
+
+  // Any callable, inlined into the loop. The std::function overloads below
+  // forward here and stay for callers that already hold one.
+  template<typename Func>
+  void _map(Func mapper) {
+    _detach();
+    MatType *v = values;
+    for (int i = 0; i < rows * cols; ++i) {
+      v[i] = mapper(v[i]);
+    }
+  }
+
+  void _map(std::function<MatType(MatType val)> mapper) {
+    _map<std::function<MatType(MatType val)> &>(mapper);
+  }
+
+  template<typename Func>
+  Mat<MatType> map(Func mapper) const & {
+    Mat<MatType> copy(*this);
+    copy._map(mapper);
+    return copy;
+  }
+
+  // a temporary is mapped in place and handed on
+  template<typename Func>
+  Mat<MatType> map(Func mapper) && {
+    _map(mapper);
+    return std::move(*this);
+  }
+
+  Mat<MatType> map(std::function<MatType(MatType val)> mapper) const & {
+    return map<std::function<MatType(MatType val)> &>(mapper);
+  }
+
+  Mat<MatType> map(std::function<MatType(MatType val)> mapper) && {
+    return std::move(*this).template map<std::function<MatType(MatType val)> &>(mapper);
+  }
+
+  // mapper(val) or mapper(val, idx), idx being the column
+  template<typename Func>
+  void _mapRow(int row, Func mapper) {
+    _detach();
+    MatType *v = values + row * cols;
+    for (int i = 0; i < cols; ++i) {
+      if constexpr (std::is_invocable<Func &, MatType, int>::value) {
+        v[i] = mapper(v[i], i);
+      } else {
+        v[i] = mapper(v[i]);
+      }
+    }
+  }
+
+  // mapper(val) or mapper(val, idx), idx being the row
+  template<typename Func>
+  void _mapCol(int col, Func mapper) {
+    _detach();
+    MatType *v = values + col;
+    for (int i = 0; i < rows; ++i) {
+      if constexpr (std::is_invocable<Func &, MatType, int>::value) {
+        v[i * cols] = mapper(v[i * cols], i);
+      } else {
+        v[i * cols] = mapper(v[i * cols]);
+      }
+    }
+  }
+
+  void _mapRow(int row, std::function<MatType(MatType val)> mapper) {
+    _mapRow<std::function<MatType(MatType val)> &>(row, mapper);
+  }
+
+  void _mapCol(int col, std::function<MatType(MatType val)> mapper) {
+    _mapCol<std::function<MatType(MatType val)> &>(col, mapper);
+  }
+
+  void _mapRow(int row, std::function<MatType(MatType val, int idx)> mapper) {
+    _mapRow<std::function<MatType(MatType val, int idx)> &>(row, mapper);
+  }
+
+  void _mapCol(int col, std::function<MatType(MatType val, int idx)> mapper) {
+    _mapCol<std::function<MatType(MatType val, int idx)> &>(col, mapper);
+  }
+
+  void _add(const Mat &other) {
+    _detach();
+    MatType *v = values;
+    const MatType *o = other.values;
+    for (int i = 0; i < rows * cols; ++i) {
+      v[i] += o[i];
+    }
+  }
+
+  template<typename ViewType>
+  void _add(const MatView<ViewType> &other) {
+    _view()._add(other);
+  }
+
+  // zero-copy views, see MatView
+  MatView<MatType> view() {
+    MatView<MatType> ret = _view();
+    viewed = true;
+    return ret;
+  }
+
+  // a writable view for a write made right away, which leaves the buffer
+  // shareable
+  MatView<MatType> _view() {
+    _detach();
+    return MatView<MatType>(values, rows, cols, cols, 1);
+  }
+
+  MatView<const MatType> view() const {
+    return MatView<const MatType>(values, rows, cols, cols, 1);
+  }
+
+  MatView<MatType> block(int r, int c, int blockRows, int blockCols) {
+    return view().block(r, c, blockRows, blockCols);
+  }
+
+  MatView<const MatType> block(int r, int c, int blockRows, int blockCols) const {
+    return view().block(r, c, blockRows, blockCols);
+  }
+
+  MatView<MatType> row(int r) {
+    return view().row(r);
+  }
+
+  MatView<const MatType> row(int r) const {
+    return view().row(r);
+  }
+
+  MatView<MatType> col(int c) {
+    return view().col(c);
+  }
+
+  MatView<const MatType> col(int c) const {
+    return view().col(c);
+  }
+
+  Mat<MatType> add(const Mat &other) const & {
+    Mat<MatType> copy(*this);
+    copy._add(other);
+    return copy;
+  }
+
+  Mat<MatType> add(const Mat &other) && {
+    _add(other);
+    return std::move(*this);
+  }
+
+  Mat<MatType> mul(const Mat &other) const {
+    return mul(other, 1);
+  }
+
+  template<typename ViewType>
+  Mat<MatType> mul(const MatView<ViewType> &other, int threads=1) const {
+    return view().mul(other, threads);
+  }
+
+  // threads <= 0 uses every hardware thread; small products stay serial
+  Mat<MatType> mul(const Mat &other, int threads) const {
+    Mat<MatType> copy(rows, other.cols);
+    if constexpr (std::is_same<MatType, float>::value || std::is_same<MatType, double>::value) {
+      if ((long long) rows * other.cols * cols >= gemmThreshold) {
+        for (int i = 0; i < rows * other.cols; ++i) {
+          copy.set(i, 0);
+        }
+        parallelGemm<MatType>(threads > 0 ? threads : defaultThreads(), rows, other.cols, cols, 1,
+                              values, cols, 1, other.values, other.cols, 1, copy.values, other.cols, 1);
+        return copy;
+      }
+    }
+    for (int i = 0; i < this->rows; ++i) {
+      for (int j = 0; j < other.cols; ++j) {
+        MatType val = 0;
+        for (int k = 0; k < this->cols; ++k) {
+          val += get(i, k) * other.get(k, j);
+        }
+        copy.set(i, j, val);
+      }
+    }
+    return copy;
+  }
+
+  // this^T * other without forming the transpose
+  Mat<MatType> tmul(const Mat &other) const {
+    Mat<MatType> copy(cols, other.cols);
+    if constexpr (std::is_same<MatType, float>::value || std::is_same<MatType, double>::value) {
+      if ((long long) cols * other.cols * rows >= gemmThreshold) {
+        for (int i = 0; i < cols * other.cols; ++i) {
+          copy.set(i, 0);
+        }
+        gemm<MatType>(cols, other.cols, rows, 1, values, 1, cols, other.values, other.cols, 1, copy.values, other.cols, 1);
+        return copy;
+      }
+    }
+    for (int i = 0; i < cols; ++i) {
+      for (int j = 0; j < other.cols; ++j) {
+        MatType val = 0;
+        for (int k = 0; k < rows; ++k) {
+          val += get(k, i) * other.get(k, j);
+        }
+        copy.set(i, j, val);
+      }
+    }
+    return copy;
+  }
+
+  // A^T A as a symmetric rank-k update: only the upper triangle is
+  // accumulated and then mirrored. Large products run on the packed gemm,
+  // one block of gramBlock rows of A^T A at a time, from its diagonal on;
+  // small ones go one row of A at a time.
+  static constexpr int gramBlock = 2 * GemmBlocking<double>::MC;
+
+  Mat<MatType> gram() const {
+    Mat<MatType> ret = zeros(cols, cols);
+    MatType *g = ret.values;
+    if constexpr (std::is_same<MatType, float>::value || std::is_same<MatType, double>::value) {
+      if ((long long) cols * cols * rows >= gemmThreshold) {
+        for (int i0 = 0; i0 < cols; i0 += gramBlock) {
+          gemm<MatType>(std::min(gramBlock, cols - i0), cols - i0, rows, 1,
+                        values + i0, 1, cols,
+                        values + i0, cols, 1,
+                        g + i0 * cols + i0, cols, 1);
+        }
+        ret._mirrorUpper();
+        return ret;
+      }
+    }
+    for (int r = 0; r < rows; ++r) {
+      const MatType *row = values + r * cols;
+      for (int i = 0; i < cols; ++i) {
+        MatType ai = row[i];
+        MatType *gi = g + i * cols;
+        for (int j = i; j < cols; ++j) {
+          gi[j] += ai * row[j];
+        }
+      }
+    }
+    ret._mirrorUpper();
+    return ret;
+  }
+
+  // copies the upper triangle of a square matrix into the lower one
+  void _mirrorUpper() {
+    for (int i = 0; i < cols; ++i) {
+      for (int j = 0; j < i; ++j) {
+        values[i * cols + j] = values[j * cols + i];
+      }
+    }
+  }
+
+  void _swapRows(int a, int b) {
+    if (a == b) {
+      return;
+    }
+    MatType tmp;
+    for (int i = 0; i < cols; ++i) {
+      tmp = get(a, i);
+      set(a, i, get(b, i));
+      set(b, i, tmp);
+    }
+  }
+
+  void _swapRows(int a, int b, Mat &attached) {
+    _swapRows(a, b);
+    attached._swapRows(a, b);
+  }
+
+  // Row (column) whose preprocessed entry in col (row) is largest or
+  // smallest, the first one on ties. The preprocessor defaults to identity.
+  template<typename Func=MatIdentity>
+  int maxRowInCol(int col, Func preprocessor=Func(), int maxRow=-1, int minRow=0) {
+    return _bestInLine(values + col, cols, minRow, maxRow < 0 ? rows : maxRow, preprocessor, std::greater<MatType>());
+  }
+
+  template<typename Func=MatIdentity>
+  int minRowInCol(int col, Func preprocessor=Func(), int maxRow=-1, int minRow=0) {
+    return _bestInLine(values + col, cols, minRow, maxRow < 0 ? rows : maxRow, preprocessor, std::less<MatType>());
+  }
+
+  template<typename Func=MatIdentity>
+  int maxColInRow(int row, Func preprocessor=Func(), int maxCol=-1, int minCol=0) {
+    return _bestInLine(values + row * cols, 1, minCol, maxCol < 0 ? cols : maxCol, preprocessor, std::greater<MatType>());
+  }
+
+  template<typename Func=MatIdentity>
+  int minColInRow(int row, Func preprocessor=Func(), int maxCol=-1, int minCol=0) {
+    return _bestInLine(values + row * cols, 1, minCol, maxCol < 0 ? cols : maxCol, preprocessor, std::less<MatType>());
+  }
+
+  int maxRowInCol(int col, std::function<MatType(MatType)> preprocessor, int maxRow=-1, int minRow=0) {
+    return maxRowInCol<std::function<MatType(MatType)> &>(col, preprocessor, maxRow, minRow);
+  }
+
+  int minRowInCol(int col, std::function<MatType(MatType)> preprocessor, int maxRow=-1, int minRow=0) {
+    return minRowInCol<std::function<MatType(MatType)> &>(col, preprocessor, maxRow, minRow);
+  }
+
+  int maxColInRow(int row, std::function<MatType(MatType)> preprocessor, int maxCol=-1, int minCol=0) {
+    return maxColInRow<std::function<MatType(MatType)> &>(row, preprocessor, maxCol, minCol);
+  }
+
+  int minColInRow(int row, std::function<MatType(MatType)> preprocessor, int maxCol=-1, int minCol=0) {
+    return minColInRow<std::function<MatType(MatType)> &>(row, preprocessor, maxCol, minCol);
+  }
+
+  // index in [from, to) of the best preprocessed entry of line[i * stride]
+  template<typename Func, typename Better>
+  static int _bestInLine(const MatType *line, int stride, int from, int to, Func &preprocessor, Better better) {
+    if (from >= to) {
+      return from;
+    }
+    int ret = from;
+    MatType best = preprocessor(line[from * stride]);
+    for (int i = from + 1; i < to; ++i) {
+      MatType val = preprocessor(line[i * stride]);
+      if (better(val, best)) {
+        best = val;
+        ret = i;
+      }
+    }
+    return ret;
+  }
+
+  // in place for square matrices, a non-square one gets a new buffer
+  void _transpose() {
+    if (rows != cols) {
+      *this = transpose();
+      return;
+    }
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        if (i > j) {
+          MatType val = get(i, j);
+          set(i, j, get(j, i));
+          set(j, i, val);
+        }
+      }
+    }
+  }
+
+  Mat<MatType> transpose() const & {
+    Mat<MatType> ret(cols, rows);
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        ret.set(j, i, get(i, j));
+      }
+    }
+    return ret;
+  }
+
+  Mat<MatType> transpose() && {
+    _transpose();
+    return std::move(*this);
+  }
+
+  // row dst -= multiplier * row src, from column `from` on
+  void _subRow(int dst, int src, MatType multiplier, int from=0) {
+    _detach();
+    MatType *d = values + dst * cols;
+    const MatType *s = values + src * cols;
+    for (int i = from; i < cols; ++i) {
+      d[i] -= multiplier * s[i];
+    }
+  }
+
+  // row of the entry with the largest magnitude in col, from row minRow down
+  int maxAbsRowInCol(int col, int minRow=0) {
+    int r = minRow;
+    MatType best = -1;
+    const MatType *p = values + minRow * cols + col;
+    for (int i = minRow; i < rows; ++i, p += cols) {
+      MatType val = std::abs(*p);
+      if (val > best) {
+        best = val;
+        r = i;
+      }
+    }
+    return r;
+  }
+
+  // Forward elimination with partial pivoting. The pivot of the next column
+  // is tracked while the rows below are updated, so choosing it costs no
+  // extra pass over the column. Returns the number of row swaps.
+  int _triangulate(Mat &attached) {
+    int swaps = 0;
+    int n = std::min(rows, cols);
+    int pivot = n > 0 ? maxAbsRowInCol(0) : 0;
+    for (int currentRow = 0; currentRow < n; ++currentRow) {
+      if (pivot != currentRow) {
+        _swapRows(currentRow, pivot, attached);
+        ++swaps;
+      }
+      int nextCol = currentRow + 1;
+      pivot = nextCol;
+      MatType best = -1;
+      MatType diag = get(currentRow, currentRow);
+      for (int subRow = currentRow + 1; subRow < rows; ++subRow) {
+        MatType multiplier = diag == 0 ? 0 : get(subRow, currentRow) / diag;
+        if (multiplier != 0) {
+          _subRow(subRow, currentRow, multiplier, currentRow);
+          set(subRow, currentRow, 0);
+          attached._subRow(subRow, currentRow, multiplier);
+        }
+        if (nextCol < cols && std::abs(get(subRow, nextCol)) > best) {
+          best = std::abs(get(subRow, nextCol));
+          pivot = subRow;
+        }
+      }
+    }
+    return swaps;
+  }
+
+  void _diagonalize(Mat &attached) {
+    _triangulate(attached);
+    for (int currentRow = rows - 1; currentRow >= 0; --currentRow) {
+      for (int subRow = 0; subRow < currentRow; ++subRow) {
+        MatType multiplier = get(subRow, currentRow) / get(currentRow, currentRow);
+        set(subRow, currentRow, get(subRow, currentRow) - multiplier * get(currentRow, currentRow));
+        attached._subRow(subRow, currentRow, multiplier);
+      }
+    }
+  }
+
+  void _toOnes(Mat &attached) {
+    _diagonalize(attached);
+    for (int i = 0; i < rows; ++i) {
+      attached._mapRow(i, [&](MatType val) { return val / get(i, i); });
+      set(i, i, 1);
+    }
+  }
+
+  // inv, det, logAbsDet and solve go through the blocked LU from
+  // luBlockThreshold rows on, which spreads its updates across `threads`
+  // threads (threads <= 0 uses every hardware thread); serial by default
+  Mat<MatType> inv(int threads=1) const & {
+    return Mat<MatType>(*this).inv(threads);
+  }
+
+  // a temporary is eliminated in place instead of being copied first
+  Mat<MatType> inv(int threads=1) && {
+    if (rows >= luBlockThreshold) {
+      return LU<MatType>(std::move(*this), threads).inv();
+    }
+    Mat<MatType> ret = eyeLike(*this);
+    _toOnes(ret);
+    return ret;
+  }
+
+  // product of the pivots of one forward elimination pass, signed by the
+  // parity of the row swaps
+  MatType det(int threads=1) {
+    if (rows >= luBlockThreshold) {
+      return LU<MatType>(*this, threads).det();
+    }
+    Mat<MatType> copy(*this);
+    Mat<MatType> dummy(rows, 0);
+    int swaps = copy._triangulate(dummy);
+    MatType ret = swaps % 2 ? -1 : 1;
+    for (int i = 0; i < rows; ++i) {
+      ret *= copy.get(i, i);
+    }
+    return ret;
+  }
+
+  // log |det|, which does not overflow for large or badly scaled matrices.
+  // sign, if given, receives the sign of det (0 for a singular matrix).
+  MatType logAbsDet(int *sign=nullptr, int threads=1) {
+    if (rows >= luBlockThreshold) {
+      return LU<MatType>(*this, threads).logAbsDet(sign);
+    }
+    Mat<MatType> copy(*this);
+    Mat<MatType> dummy(rows, 0);
+    int swaps = copy._triangulate(dummy);
+    return _logAbsDiagonal(copy, swaps, sign);
+  }
+
+  static MatType _logAbsDiagonal(const Mat &triangular, int swaps, int *sign) {
+    int s = swaps % 2 ? -1 : 1;
+    MatType ret = 0;
+    for (int i = 0; i < triangular.rows; ++i) {
+      MatType val = triangular.get(i, i);
+      if (val < 0) {
+        s = -s;
+      } else if (val == 0) {
+        s = 0;
+      }
+      ret += std::log(std::abs(val));
+    }
+    if (sign) {
+      *sign = s;
+    }
+    return ret;
+  }
+
+  // x with A x = b for every column of b
+  Mat<MatType> solve(const Mat &b, int threads=1) const {
+    return LU<MatType>(*this, threads).solve(b);
+  }
+
+  bool equals(const Mat &other) const {
+    if (rows != other.rows || cols != other.cols) {
+      return false;
+    }
+    for (int i = 0; i < rows * cols; ++i) {
+      if (get(i) != other.get(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool isnan() {
+    for (int i = 0; i < rows * cols; ++i) {
+      MatType val = *(values + i);
+      if (std::isnan(val)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool isinf() {
+    for (int i = 0; i < rows * cols; ++i) {
+      MatType val = *(values + i);
+      if (std::isinf(val)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void print(std::ostream &to, std::string name="") {
+    if (!name.empty()) {
+      to << name << " =" << std::endl;
+    }
+    to << std::setprecision(3);
+    for (int r = 0; r < rows; ++r) {
+      to << "| ";
+      for (int c = 0; c < cols; ++c) {
+        to << get(r, c) << "\t";
+      }
+      to << "|\n";
+    }
+    to << std::endl;
+  }
+
+  // "rows cols" and then the values row by row, whitespace separated
+  void input(std::istream &from) {
+    int newRows, newCols;
+    from >> newRows >> newCols;
+    if (!from || newRows < 0 || newCols < 0) {
+      throw std::runtime_error("cannot read the matrix size");
+    }
+    if (shared || newRows * newCols != rows * cols) {
+      _release();
+      values = _allocate(newRows * newCols);
+      if (copyOnWrite) {
+        _countRefs();
+      }
+    }
+    rows = newRows;
+    cols = newCols;
+    for (int i = 0; i < rows * cols; ++i) {
+      from >> values[i];
+    }
+    if (!from) {
+      throw std::runtime_error("cannot read the matrix values");
+    }
+  }
+
+  // binary matrix file contents, see MatFileHeader
+  void write(std::ostream &to, MatLayout layout=MatLayout::RowMajor) const {
+    MatFileHeader header = {};
+    std::memcpy(header.magic, matFileMagic, sizeof(matFileMagic));
+    header.version = matFileVersion;
+    header.byteOrder = matFileByteOrder;
+    header.dtype = matDtype<MatType>();
+    header.elementSize = sizeof(MatType);
+    header.layout = (uint32_t) layout;
+    header.rows = rows;
+    header.cols = cols;
+    to.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    if (layout == MatLayout::RowMajor) {
+      to.write(reinterpret_cast<const char *>(values), (std::streamsize) rows * cols * sizeof(MatType));
+    } else {
+      Mat<MatType> t = transpose();
+      to.write(reinterpret_cast<const char *>(t.values), (std::streamsize) rows * cols * sizeof(MatType));
+    }
+  }
+
+  // reads what write() wrote, in either layout; name is used in errors
+  static Mat<MatType> read(std::istream &from, const std::string &name="stream") {
+    MatFileHeader header;
+    if (!from.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+      throw std::runtime_error(name + ": not a matrix file");
+    }
+    checkMatFileHeader<MatType>(header, UINT64_MAX, name);
+    int r = (int) header.rows;
+    int c = (int) header.cols;
+    bool colMajor = header.layout == (uint32_t) MatLayout::ColMajor;
+    Mat<MatType> ret(colMajor ? c : r, colMajor ? r : c);
+    if (!from.read(reinterpret_cast<char *>(ret.values), (std::streamsize) r * c * sizeof(MatType))) {
+      throw std::runtime_error(name + ": truncated");
+    }
+    return colMajor ? std::move(ret).transpose() : std::move(ret);
+  }
+};
+
+template<typename MatType>
+void saveMat(const std::string &path, const Mat<MatType> &m, MatLayout layout=MatLayout::RowMajor) {
+  std::ofstream to(path, std::ios::binary);
+  if (!to) {
+    throw std::runtime_error(path + ": cannot open for writing");
+  }
+  m.write(to, layout);
+  to.close();
+  if (!to) {
+    throw std::runtime_error(path + ": write failed");
+  }
+}
+
+template<typename MatType>
+Mat<MatType> loadMat(const std::string &path) {
+  std::ifstream from(path, std::ios::binary);
+  if (!from) {
+    throw std::runtime_error(path + ": cannot open");
+  }
+  return Mat<MatType>::read(from, path);
+}
+
+// A matrix file mapped read-only by mapMat. It only hands out read access,
+// which goes straight to the file pages. mat() is a copy-on-write Mat over
+// the same pages for everything that takes a Mat; its first write moves it
+// to a private heap copy, the file is never changed.
+template<typename MatType>
+struct MappedMat {
+  int rows, cols;
+  Mat<MatType> _mapped;
+
+  explicit MappedMat(Mat<MatType> &&mapped) : rows(mapped.rows), cols(mapped.cols), _mapped(std::move(mapped)) {}
+
+  MatType get(int r, int c) const {
+    return _mapped.get(r, c);
+  }
+
+  MatView<const MatType> view() const {
+    return _mapped.view();
+  }
+
+  MatView<const MatType> block(int r, int c, int blockRows, int blockCols) const {
+    return _mapped.block(r, c, blockRows, blockCols);
+  }
+
+  MatView<const MatType> row(int r) const {
+    return _mapped.row(r);
+  }
+
+  MatView<const MatType> col(int c) const {
+    return _mapped.col(c);
+  }
+
+  Mat<MatType> mat() const {
+    return _mapped;
+  }
+};
+
+// Maps a row-major matrix file read-only, with no parse or copy step. The
+// mapping goes away with the last matrix sharing it.
+template<typename MatType>
+MappedMat<MatType> mapMat(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(path + ": cannot open");
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(MatFileHeader)) {
+    close(fd);
+    throw std::runtime_error(path + ": not a matrix file");
+  }
+  size_t size = info.st_size;
+  void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    throw std::runtime_error(path + ": cannot map");
+  }
+  const MatFileHeader &header = *static_cast<const MatFileHeader *>(base);
+  try {
+    checkMatFileHeader<MatType>(header, size - sizeof(MatFileHeader), path);
+    if (header.layout != (uint32_t) MatLayout::RowMajor) {
+      throw std::runtime_error(path + ": column-major, read it with loadMat");
+    }
+  } catch (...) {
+    munmap(base, size);
+    throw;
+  }
+  MatType *data = reinterpret_cast<MatType *>(static_cast<char *>(base) + sizeof(MatFileHeader));
+  MatShared *shared = new MatShared([base, size] { munmap(base, size); }, true);
+  return MappedMat<MatType>(Mat<MatType>((int) header.rows, (int) header.cols, data, shared));
+}
+
+// Non-owning window into the values of a Mat: entry (r, c) is
+// data[r * rowStride + c * colStride]. Blocks, rows, columns, every k-th
+// row or column and transposes are all views of this one shape, so taking
+// them copies nothing and writing through them changes the matrix. A view
+// is only valid while the matrix keeps its buffer. MatView<const T> is the
+// read-only kind, a MatView<T> converts to it.
+template<typename MatType>
+struct MatView {
+  typedef typename std::remove_const<MatType>::type Scalar;
+  MatType *data;
+  int rows, cols;
+  int rowStride, colStride;
+
+  MatView(MatType *data, int rows, int cols, int rowStride, int colStride)
+      : data(data), rows(rows), cols(cols), rowStride(rowStride), colStride(colStride) {}
+
+  template<typename Other, typename = typename std::enable_if<std::is_same<const Other, MatType>::value
+                                                             && !std::is_same<Other, MatType>::value>::type>
+  MatView(const MatView<Other> &from)
+      : data(from.data), rows(from.rows), cols(from.cols), rowStride(from.rowStride), colStride(from.colStride) {}
+
+  Scalar get(int r, int c) const {
+    return data[r * rowStride + c * colStride];
+  }
+
+  Scalar set(int r, int c, Scalar val) const {
+    data[r * rowStride + c * colStride] = val;
+    return val;
+  }
+
+  MatView block(int r, int c, int blockRows, int blockCols) const {
+    return MatView(data + r * rowStride + c * colStride, blockRows, blockCols, rowStride, colStride);
+  }
+
+  MatView row(int r) const {
+    return block(r, 0, 1, cols);
+  }
+
+  MatView col(int c) const {
+    return block(0, c, rows, 1);
+  }
+
+  // every rowStep-th row and colStep-th column, starting with the first
+  MatView strided(int rowStep, int colStep) const {
+    return MatView(data, (rows + rowStep - 1) / rowStep, (cols + colStep - 1) / colStep,
+                   rowStride * rowStep, colStride * colStep);
+  }
+
+  MatView transpose() const {
+    return MatView(data, cols, rows, colStride, rowStride);
+  }
+
+  template<typename Func>
+  void _map(Func mapper) const {
+    for (int i = 0; i < rows; ++i) {
+      MatType *p = data + i * rowStride;
+      for (int j = 0; j < cols; ++j, p += colStride) {
+        *p = mapper(*p);
+      }
+    }
+  }
+
+  template<typename Other>
+  void _add(const MatView<Other> &other) const {
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        set(i, j, get(i, j) + other.get(i, j));
+      }
+    }
+  }
+
+  // copies other into the viewed entries
+  template<typename Other>
+  void _assign(const MatView<Other> &other) const {
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        set(i, j, other.get(i, j));
+      }
+    }
+  }
+
+  // the strides go to gemm as they are, no operand is copied first
+  template<typename Other>
+  Mat<Scalar> mul(const MatView<Other> &other, int threads=1) const {
+    Mat<Scalar> ret = Mat<Scalar>::zeros(rows, other.cols);
+    if constexpr (std::is_same<Scalar, float>::value || std::is_same<Scalar, double>::value) {
+      if ((long long) rows * other.cols * cols >= gemmThreshold) {
+        parallelGemm<Scalar>(threads > 0 ? threads : defaultThreads(), rows, other.cols, cols, 1,
+                             data, rowStride, colStride, other.data, other.rowStride, other.colStride,
+                             ret.values, other.cols, 1);
+        return ret;
+      }
+    }
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < other.cols; ++j) {
+        Scalar val = 0;
+        for (int k = 0; k < cols; ++k) {
+          val += get(i, k) * other.get(k, j);
+        }
+        ret.set(i, j, val);
+      }
+    }
+    return ret;
+  }
+
+  Mat<Scalar> mul(const Mat<Scalar> &other, int threads=1) const {
+    return mul(other.view(), threads);
+  }
+};
+
+// Lazy elementwise expressions over Mat. lazy(a).add(b).map(f).scale(2) only
+// builds a tree of small nodes; assigning it to a Mat evaluates every element
+// once, in a single pass, without intermediate matrices. Nodes keep
+// references to the matrices they read, so those must outlive the expression.
+// Products are not elementwise: mul() hands the operands to gemm, with
+// transposes and scales folded into its strides and alpha.
+//
+// Every node provides rows(), cols(), get(r, c) and, when `linear` is set,
+// get(idx) in row-major order, which lets the evaluation run as one flat loop.
+template<typename Expr, typename MatType>
+struct MatExpr {
+  const Expr &self() const {
+    return static_cast<const Expr &>(*this);
+  }
+
+  void evalTo(MatType *dst) const {
+    const Expr &e = self();
+    int rows = e.rows();
+    int cols = e.cols();
+    if constexpr (Expr::linear) {
+      for (int i = 0; i < rows * cols; ++i) {
+        dst[i] = e.get(i);
+      }
+    } else {
+      for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) {
+          dst[i * cols + j] = e.get(i, j);
+        }
+      }
+    }
+  }
+
+  Mat<MatType> eval() const {
+    return Mat<MatType>(*this);
+  }
+
+  template<typename Other>
+  MatSum<Expr, Other> add(const MatExpr<Other, MatType> &other) const {
+    return MatSum<Expr, Other>(self(), other.self());
+  }
+
+  MatSum<Expr, MatRef<MatType>> add(const Mat<MatType> &other) const {
+    return MatSum<Expr, MatRef<MatType>>(self(), MatRef<MatType>(other));
+  }
+
+  template<typename Func>
+  MatMap<Expr, Func> map(Func mapper) const {
+    return MatMap<Expr, Func>(self(), mapper);
+  }
+
+  MatScale<Expr> scale(MatType factor) const {
+    return MatScale<Expr>(self(), factor);
+  }
+
+  MatTranspose<Expr> transpose() const {
+    return MatTranspose<Expr>(self());
+  }
+
+  // threads <= 0 uses every hardware thread
+  template<typename Other>
+  Mat<MatType> mul(const MatExpr<Other, MatType> &other, int threads=1) const {
+    GemmOperand<MatType> a = gemmOperand(self());
+    GemmOperand<MatType> b = gemmOperand(other.self());
+    Mat<MatType> ret = Mat<MatType>::zeros(a.rows, b.cols);
+    if constexpr (std::is_same<MatType, float>::value || std::is_same<MatType, double>::value) {
+      parallelGemm<MatType>(threads > 0 ? threads : defaultThreads(), a.rows, b.cols, a.cols, a.alpha * b.alpha,
+                            a.data, a.rs, a.cs, b.data, b.rs, b.cs, ret.values, b.cols, 1);
+    } else {
+      gemmAny<MatType>(a.rows, b.cols, a.cols, a.alpha * b.alpha,
+                       a.data, a.rs, a.cs, b.data, b.rs, b.cs, ret.values, b.cols, 1);
+    }
+    return ret;
+  }
+
+  Mat<MatType> mul(const Mat<MatType> &other, int threads=1) const {
+    return mul(MatRef<MatType>(other), threads);
+  }
+};
+
+template<typename MatType>
+struct MatRef : MatExpr<MatRef<MatType>, MatType> {
+  typedef MatType Scalar;
+  static constexpr bool linear = true;
+  const Mat<MatType> &m;
+
+  explicit MatRef(const Mat<MatType> &m) : m(m) {}
+
+  int rows() const { return m.rows; }
+  int cols() const { return m.cols; }
+  MatType get(int idx) const { return m.values[idx]; }
+  MatType get(int r, int c) const { return m.values[r * m.cols + c]; }
+  bool refers(const MatType *p) const { return m.values == p; }
+};
+
+template<typename Left, typename Right>
+struct MatSum : MatExpr<MatSum<Left, Right>, typename Left::Scalar> {
+  typedef typename Left::Scalar Scalar;
+  static constexpr bool linear = Left::linear && Right::linear;
+  Left left;
+  Right right;
+
+  MatSum(const Left &left, const Right &right) : left(left), right(right) {}
+
+  int rows() const { return left.rows(); }
+  int cols() const { return left.cols(); }
+  Scalar get(int idx) const { return left.get(idx) + right.get(idx); }
+  Scalar get(int r, int c) const { return left.get(r, c) + right.get(r, c); }
+  bool refers(const Scalar *p) const { return left.refers(p) || right.refers(p); }
+};
+
+template<typename Inner, typename Func>
+struct MatMap : MatExpr<MatMap<Inner, Func>, typename Inner::Scalar> {
+  typedef typename Inner::Scalar Scalar;
+  static constexpr bool linear = Inner::linear;
+  Inner inner;
+  Func mapper;
+
+  MatMap(const Inner &inner, Func mapper) : inner(inner), mapper(mapper) {}
+
+  int rows() const { return inner.rows(); }
+  int cols() const { return inner.cols(); }
+  Scalar get(int idx) const { return mapper(inner.get(idx)); }
+  Scalar get(int r, int c) const { return mapper(inner.get(r, c)); }
+  bool refers(const Scalar *p) const { return inner.refers(p); }
+};
+
+template<typename Inner>
+struct MatScale : MatExpr<MatScale<Inner>, typename Inner::Scalar> {
+  typedef typename Inner::Scalar Scalar;
+  static constexpr bool linear = Inner::linear;
+  Inner inner;
+  Scalar factor;
+
+  MatScale(const Inner &inner, Scalar factor) : inner(inner), factor(factor) {}
+
+  int rows() const { return inner.rows(); }
+  int cols() const { return inner.cols(); }
+  Scalar get(int idx) const { return factor * inner.get(idx); }
+  Scalar get(int r, int c) const { return factor * inner.get(r, c); }
+  bool refers(const Scalar *p) const { return inner.refers(p); }
+};
+
+template<typename Inner>
+struct MatTranspose : MatExpr<MatTranspose<Inner>, typename Inner::Scalar> {
+  typedef typename Inner::Scalar Scalar;
+  static constexpr bool linear = false;
+  Inner inner;
+
+  explicit MatTranspose(const Inner &inner) : inner(inner) {}
+
+  int rows() const { return inner.cols(); }
+  int cols() const { return inner.rows(); }
+  Scalar get(int r, int c) const { return inner.get(c, r); }
+  bool refers(const Scalar *p) const { return inner.refers(p); }
+};
+
+// starts an expression on a; a temporary would be gone before evaluation
+template<typename MatType>
+MatRef<MatType> lazy(const Mat<MatType> &a) {
+  return MatRef<MatType>(a);
+}
+
+template<typename MatType>
+void lazy(Mat<MatType> &&a) = delete;
+
+// A gemm operand: data addressed by strides, times alpha. Matrices and
+// their transposes and scales are used in place, any other expression is
+// evaluated into `owned` first.
+template<typename MatType>
+struct GemmOperand {
+  const MatType *data;
+  int rows, cols, rs, cs;
+  MatType alpha;
+  Mat<MatType> owned;
+};
+
+template<typename Expr, typename MatType>
+GemmOperand<MatType> gemmOperand(const MatExpr<Expr, MatType> &expr) {
+  Mat<MatType> owned(expr);
+  const MatType *data = owned.values;
+  return {data, owned.rows, owned.cols, owned.cols, 1, 1, std::move(owned)};
+}
+
+template<typename MatType>
+GemmOperand<MatType> gemmOperand(const MatRef<MatType> &ref) {
+  return {ref.m.values, ref.m.rows, ref.m.cols, ref.m.cols, 1, 1, Mat<MatType>(0, 0)};
+}
+
+template<typename Inner>
+GemmOperand<typename Inner::Scalar> gemmOperand(const MatTranspose<Inner> &t) {
+  GemmOperand<typename Inner::Scalar> op = gemmOperand(t.inner);
+  std::swap(op.rows, op.cols);
+  std::swap(op.rs, op.cs);
+  return op;
+}
+
+template<typename Inner>
+GemmOperand<typename Inner::Scalar> gemmOperand(const MatScale<Inner> &s) {
+  GemmOperand<typename Inner::Scalar> op = gemmOperand(s.inner);
+  op.alpha *= s.factor;
+  return op;
+}
+
+// LU factorization with partial pivoting, P A = L U. L (unit lower, diagonal
+// not stored) and U share the lu matrix. Factor once, then solve any number
+// of right-hand sides in O(n^2) each; det and the inverse come from the factors.
+template<typename MatType>
+struct LU {
+  Mat<MatType> lu;
+  // row i of P A is row perm[i] of A
+  std::vector<int> perm;
+  int swaps = 0;
+
+  int threads;
+
+  // threads <= 0 uses every hardware thread; they are only started for
+  // float and double matrices of at least luBlockThreshold rows. Serial by
+  // default like mul(), so inv(), det() and solve() never start threads
+  // of their own.
+  LU(Mat<MatType> a, int threads=1) : lu(std::move(a)), perm(lu.rows), threads(threads > 0 ? threads : defaultThreads()) {
+    lu._detach();
+    for (int i = 0; i < lu.rows; ++i) {
+      perm[i] = i;
+    }
+    if constexpr (std::is_same<MatType, float>::value || std::is_same<MatType, double>::value) {
+      if (lu.rows >= luBlockThreshold) {
+        _factorBlocked();
+        return;
+      }
+    }
+    _factor(0, lu.rows, lu.rows);
+  }
+
+  // Unblocked elimination of columns [from, to), with the rank-1 updates
+  // restricted to columns below updateTo. Row swaps cover whole rows, which
+  // keeps the factors of earlier panels and the later columns consistent.
+  void _factor(int from, int to, int updateTo) {
+    int n = lu.rows;
+    MatType *v = lu.values;
+    for (int k = from; k < to; ++k) {
+      int pivot = k;
+      for (int i = k + 1; i < n; ++i) {
+        if (std::abs(v[i * n + k]) > std::abs(v[pivot * n + k])) {
+          pivot = i;
+        }
+      }
+      if (pivot != k) {
+        lu._swapRows(k, pivot);
+        std::swap(perm[k], perm[pivot]);
+        ++swaps;
+      }
+      MatType diag = v[k * n + k];
+      if (diag == 0) {
+        continue;
+      }
+      for (int i = k + 1; i < n; ++i) {
+        MatType multiplier = v[i * n + k] /= diag;
+        for (int j = k + 1; j < updateTo; ++j) {
+          v[i * n + j] -= multiplier * v[k * n + j];
+        }
+      }
+    }
+  }
+
+  // Right-looking blocked LU: factor a luBlockSize wide panel, solve for the
+  // block row of U right of it, then update the trailing matrix with one
+  // gemm (A22 -= L21 U12), which is where almost all the flops are.
+  void _factorBlocked() {
+    int n = lu.rows;
+    MatType *v = lu.values;
+    for (int k0 = 0; k0 < n; k0 += luBlockSize) {
+      int kb = std::min(luBlockSize, n - k0);
+      int k1 = k0 + kb;
+      _factor(k0, k1, k1);
+      if (k1 == n) {
+        break;
+      }
+
+      // U12 = L11^-1 A12, split by columns across threads
+      int chunks = (n - k1 + luBlockSize - 1) / luBlockSize;
+      parallelFor(chunks, threads, [&](int chunk) {
+        int j0 = k1 + chunk * luBlockSize;
+        int j1 = std::min(n, j0 + luBlockSize);
+        for (int i = k0 + 1; i < k1; ++i) {
+          for (int p = k0; p < i; ++p) {
+            MatType l = v[i * n + p];
+            for (int j = j0; j < j1; ++j) {
+              v[i * n + j] -= l * v[p * n + j];
+            }
+          }
+        }
+      });
+
+      parallelGemm<MatType>(threads, n - k1, n - k1, kb, -1,
+                            v + k1 * n + k0, n, 1,
+                            v + k0 * n + k1, n, 1,
+                            v + k1 * n + k1, n, 1);
+    }
+  }
+
+  bool singular() {
+    for (int i = 0; i < lu.rows; ++i) {
+      if (lu.get(i, i) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // solves A x = b for every column of b; many columns are split across threads
+  Mat<MatType> solve(const Mat<MatType> &b) {
+    int n = lu.rows;
+    int cols = b.cols;
+    Mat<MatType> x(n, cols);
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        x.set(i, j, b.get(perm[i], j));
+      }
+    }
+    MatType *xv = x.values;
+    const MatType *v = lu.values;
+    const int chunk = 64;
+    int chunks = (cols + chunk - 1) / chunk;
+    parallelFor(chunks, (long long) n * n * cols >= parallelGemmThreshold ? threads : 1, [&](int c) {
+      int j0 = c * chunk;
+      int j1 = std::min(cols, j0 + chunk);
+      // L y = P b, whole rows of the right-hand sides at a time
+      for (int i = 1; i < n; ++i) {
+        for (int k = 0; k < i; ++k) {
+          MatType l = v[i * n + k];
+          for (int j = j0; j < j1; ++j) {
+            xv[i * cols + j] -= l * xv[k * cols + j];
+          }
+        }
+      }
+      // U x = y
+      for (int i = n - 1; i >= 0; --i) {
+        for (int k = i + 1; k < n; ++k) {
+          MatType u = v[i * n + k];
+          for (int j = j0; j < j1; ++j) {
+            xv[i * cols + j] -= u * xv[k * cols + j];
+          }
+        }
+        MatType diag = v[i * n + i];
+        for (int j = j0; j < j1; ++j) {
+          xv[i * cols + j] /= diag;
+        }
+      }
+    });
+    return x;
+  }
+
+  MatType det() {
+    MatType ret = swaps % 2 ? -1 : 1;
+    for (int i = 0; i < lu.rows; ++i) {
+      ret *= lu.get(i, i);
+    }
+    return ret;
+  }
+
+  MatType logAbsDet(int *sign=nullptr) {
+    return Mat<MatType>::_logAbsDiagonal(lu, swaps, sign);
+  }
+
+  Mat<MatType> inv() {
+    Mat<MatType> identity = Mat<MatType>::eyeLike(lu);
+    return solve(identity);
+  }
+};
+
+// rows of the trailing gemm update of the blocked LLT and LDLT
+const int choleskyTileRows = luBlockSize;
+
+// lower triangle of a, diagonal included, into the zeroed or identity to
+template<typename MatType>
+void copyLower(const Mat<MatType> &a, Mat<MatType> &to) {
+  int n = a.rows;
+  for (int i = 0; i < n; ++i) {
+    std::copy(a.values + i * n, a.values + i * n + i + 1, to.values + i * n);
+  }
+}
+
+template<typename MatType>
+void clearUpper(Mat<MatType> &l) {
+  int n = l.rows;
+  for (int i = 0; i < n; ++i) {
+    std::fill(l.values + i * n + i + 1, l.values + (i + 1) * n, 0);
+  }
+}
+
+// Trailing update of a blocked symmetric factorization after the panel of
+// columns [k0, k1): lower triangle of l[k1:, k1:] -= W L21^T, where row i of
+// W starts at w + (i - k1) * ldw and L21 is l[k1:, k0:k1]. Tiles of
+// choleskyTileRows rows stop at their diagonal block.
+template<typename MatType>
+void choleskyUpdate(Mat<MatType> &l, int k0, int k1, const MatType *w, int ldw) {
+  int n = l.rows;
+  MatType *v = l.values;
+  for (int i0 = k1; i0 < n; i0 += choleskyTileRows) {
+    int i1 = std::min(n, i0 + choleskyTileRows);
+    gemm<MatType>(i1 - i0, i1 - k1, k1 - k0, -1,
+                  w + (i0 - k1) * ldw, ldw, 1,
+                  v + k1 * n + k0, 1, n,
+                  v + i0 * n + k1, n, 1);
+  }
+}
+
+// Cholesky factorization A = L L^T of a symmetric positive definite matrix,
+// about half the work of LU. Only the lower triangle of A is read.
+// positive() is false if A turned out not to be positive definite.
+// float and double matrices from luBlockThreshold rows on are factored by
+// blocks, like LU.
+template<typename MatType>
+struct LLT {
+  Mat<MatType> l;
+  bool ok = true;
+
+  LLT(const Mat<MatType> &a) : l(Mat<MatType>::zerosLike(a)) {
+    int n = a.rows;
+    MatType *v = l.values;
+    if constexpr (std::is_same<MatType, float>::value || std::is_same<MatType, double>::value) {
+      if (n >= luBlockThreshold) {
+        copyLower(a, l);
+        _factorBlocked();
+        clearUpper(l);
+        return;
+      }
+    }
+    for (int j = 0; j < n && ok; ++j) {
+      MatType *lj = v + j * n;
+      MatType d = a.get(j, j);
+      for (int k = 0; k < j; ++k) {
+        d -= lj[k] * lj[k];
+      }
+      if (!(d > 0)) {
+        ok = false;
+        break;
+      }
+      lj[j] = std::sqrt(d);
+      for (int i = j + 1; i < n; ++i) {
+        MatType *li = v + i * n;
+        MatType sum = a.get(i, j);
+        for (int k = 0; k < j; ++k) {
+          sum -= li[k] * lj[k];
+        }
+        li[j] = sum / lj[j];
+      }
+    }
+  }
+
+  // Right-looking blocked Cholesky on the lower triangle of A copied into l,
+  // the steps of LU::_factorBlocked: factor the luBlockSize wide diagonal
+  // block, solve for the panel below it (L21 = A21 L11^-T), then update the
+  // trailing lower triangle with gemm (A22 -= L21 L21^T), a block of rows
+  // at a time. The gemm tiles also write above the diagonal, which is
+  // scratch until the end.
+  void _factorBlocked() {
+    int n = l.rows;
+    MatType *v = l.values;
+    for (int k0 = 0; k0 < n; k0 += luBlockSize) {
+      int k1 = std::min(n, k0 + luBlockSize);
+      for (int j = k0; j < k1; ++j) {
+        MatType *lj = v + j * n;
+        MatType d = lj[j];
+        for (int p = k0; p < j; ++p) {
+          d -= lj[p] * lj[p];
+        }
+        if (!(d > 0)) {
+          ok = false;
+          return;
+        }
+        lj[j] = std::sqrt(d);
+        for (int i = j + 1; i < k1; ++i) {
+          MatType *li = v + i * n;
+          MatType sum = li[j];
+          for (int p = k0; p < j; ++p) {
+            sum -= li[p] * lj[p];
+          }
+          li[j] = sum / lj[j];
+        }
+      }
+      for (int i = k1; i < n; ++i) {
+        MatType *li = v + i * n;
+        for (int j = k0; j < k1; ++j) {
+          const MatType *lj = v + j * n;
+          MatType sum = li[j];
+          for (int p = k0; p < j; ++p) {
+            sum -= li[p] * lj[p];
+          }
+          li[j] = sum / lj[j];
+        }
+      }
+      choleskyUpdate(l, k0, k1, v + k1 * n + k0, n);
+    }
+  }
+
+  bool positive() {
+    return ok;
+  }
+
+  // solves A x = b for every column of b: L y = b, then L^T x = y
+  Mat<MatType> solve(Mat<MatType> b) {
+    int n = l.rows;
+    int cols = b.cols;
+    Mat<MatType> x(std::move(b));
+    x._detach();
+    MatType *xv = x.values;
+    const MatType *v = l.values;
+    for (int i = 0; i < n; ++i) {
+      for (int k = 0; k < i; ++k) {
+        MatType lik = v[i * n + k];
+        for (int j = 0; j < cols; ++j) {
+          xv[i * cols + j] -= lik * xv[k * cols + j];
+        }
+      }
+      for (int j = 0; j < cols; ++j) {
+        xv[i * cols + j] /= v[i * n + i];
+      }
+    }
+    for (int i = n - 1; i >= 0; --i) {
+      for (int j = 0; j < cols; ++j) {
+        xv[i * cols + j] /= v[i * n + i];
+      }
+      for (int k = 0; k < i; ++k) {
+        MatType lik = v[i * n + k];
+        for (int j = 0; j < cols; ++j) {
+          xv[k * cols + j] -= lik * xv[i * cols + j];
+        }
+      }
+    }
+    return x;
+  }
+
+  MatType det() {
+    MatType ret = 1;
+    for (int i = 0; i < l.rows; ++i) {
+      ret *= l.get(i, i) * l.get(i, i);
+    }
+    return ret;
+  }
+};
+
+// A = L D L^T with unit lower L and diagonal D, for symmetric matrices that
+// may be indefinite or semidefinite; no square roots. Without pivoting, so
+// a zero in D makes positive() false and the factorization unusable.
+// Blocked like LLT from luBlockThreshold rows on.
+template<typename MatType>
+struct LDLT {
+  Mat<MatType> l;
+  std::vector<MatType> d;
+  bool ok = true;
+
+  LDLT(const Mat<MatType> &a) : l(Mat<MatType>::eyeLike(a)), d(a.rows) {
+    int n = a.rows;
+    MatType *v = l.values;
+    if constexpr (std::is_same<MatType, float>::value || std::is_same<MatType, double>::value) {
+      if (n >= luBlockThreshold) {
+        copyLower(a, l);
+        _factorBlocked();
+        clearUpper(l);
+        for (int i = 0; i < n; ++i) {
+          v[i * n + i] = 1;
+        }
+        return;
+      }
+    }
+    std::vector<MatType> ld(n);
+    for (int j = 0; j < n; ++j) {
+      MatType *lj = v + j * n;
+      MatType dj = a.get(j, j);
+      for (int k = 0; k < j; ++k) {
+        ld[k] = lj[k] * d[k];
+        dj -= lj[k] * ld[k];
+      }
+      d[j] = dj;
+      if (dj == 0) {
+        ok = false;
+        break;
+      }
+      for (int i = j + 1; i < n; ++i) {
+        MatType *li = v + i * n;
+        MatType sum = a.get(i, j);
+        for (int k = 0; k < j; ++k) {
+          sum -= li[k] * ld[k];
+        }
+        li[j] = sum / dj;
+      }
+    }
+  }
+
+  // LLT::_factorBlocked with D: the panel solve keeps W = L21 D11 as it goes,
+  // and the trailing update is A22 -= W L21^T. The diagonal of l holds A
+  // until the end, D goes to d.
+  void _factorBlocked() {
+    int n = l.rows;
+    MatType *v = l.values;
+    std::vector<MatType> ld(luBlockSize);
+    std::vector<MatType> w((size_t) n * luBlockSize);
+    for (int k0 = 0; k0 < n; k0 += luBlockSize) {
+      int k1 = std::min(n, k0 + luBlockSize);
+      int kb = k1 - k0;
+      for (int j = k0; j < k1; ++j) {
+        MatType *lj = v + j * n;
+        MatType dj = lj[j];
+        for (int p = k0; p < j; ++p) {
+          ld[p - k0] = lj[p] * d[p];
+          dj -= lj[p] * ld[p - k0];
+        }
+        d[j] = dj;
+        if (dj == 0) {
+          ok = false;
+          return;
+        }
+        for (int i = j + 1; i < k1; ++i) {
+          MatType *li = v + i * n;
+          MatType sum = li[j];
+          for (int p = k0; p < j; ++p) {
+            sum -= li[p] * ld[p - k0];
+          }
+          li[j] = sum / dj;
+        }
+      }
+      for (int i = k1; i < n; ++i) {
+        MatType *li = v + i * n;
+        MatType *wi = w.data() + (i - k1) * kb;
+        for (int j = k0; j < k1; ++j) {
+          const MatType *lj = v + j * n;
+          MatType sum = li[j];
+          for (int p = k0; p < j; ++p) {
+            sum -= wi[p - k0] * lj[p];
+          }
+          wi[j - k0] = sum;
+          li[j] = sum / d[j];
+        }
+      }
+      choleskyUpdate(l, k0, k1, w.data(), kb);
+    }
+  }
+
+  bool positive() {
+    return ok;
+  }
+
+  // L z = b, D y = z, L^T x = y
+  Mat<MatType> solve(Mat<MatType> b) {
+    int n = l.rows;
+    int cols = b.cols;
+    Mat<MatType> x(std::move(b));
+    x._detach();
+    MatType *xv = x.values;
+    const MatType *v = l.values;
+    for (int i = 1; i < n; ++i) {
+      for (int k = 0; k < i; ++k) {
+        MatType lik = v[i * n + k];
+        for (int j = 0; j < cols; ++j) {
+          xv[i * cols + j] -= lik * xv[k * cols + j];
+        }
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        xv[i * cols + j] /= d[i];
+      }
+    }
+    for (int i = n - 1; i > 0; --i) {
+      for (int k = 0; k < i; ++k) {
+        MatType lik = v[i * n + k];
+        for (int j = 0; j < cols; ++j) {
+          xv[k * cols + j] -= lik * xv[i * cols + j];
+        }
+      }
+    }
+    return x;
+  }
+
+  MatType det() {
+    MatType ret = 1;
+    for (MatType di : d) {
+      ret *= di;
+    }
+    return ret;
+  }
+};
+
+// min ||A x - b|| through the normal equations A^T A x = A^T b: A^T A is
+// formed by gram() and factored by Cholesky, falling back to LU when it is
+// not numerically positive definite. Squares the condition number of A.
+template<typename MatType>
+Mat<MatType> leastSquares(const Mat<MatType> &a, const Mat<MatType> &b) {
+  Mat<MatType> ata = a.gram();
+  Mat<MatType> atb = a.tmul(b);
+  LLT<MatType> llt(ata);
+  if (llt.positive()) {
+    return llt.solve(std::move(atb));
+  }
+  return LU<MatType>(std::move(ata)).solve(atb);
+}
+
+// Blocked Householder QR of an m x n matrix, m >= n: A = Q R. R is stored in
+// the upper triangle of qr, the Householder vectors (unit leading entry not
+// stored) below it. Every panel of qrBlockSize reflectors is also kept as a
+// block reflector I - V T V^T, so it is applied to the trailing columns, and
+// later to right-hand sides, with gemm calls. Panels are factored
+// recursively, which keeps tall panels from being swept once per column.
+// solve() gives min ||A x - b|| without forming A^T A.
+const int qrBlockSize = 32;
+
+template<typename MatType>
+struct QR {
+  Mat<MatType> qr;
+  std::vector<MatType> tau;
+  // upper triangular T of every panel, kb x kb
+  std::vector<std::vector<MatType>> blockT;
+
+  QR(Mat<MatType> a) : qr(std::move(a)), tau(qr.cols) {
+    qr._detach();
+    int n = qr.cols;
+    MatType *v = qr.values;
+    for (int k0 = 0; k0 < n; k0 += qrBlockSize) {
+      int kb = std::min(qrBlockSize, n - k0);
+      _factorPanel(k0, kb);
+      blockT.push_back(_blockT(k0, kb));
+      if (k0 + kb < n) {
+        _applyBlock(k0, kb, blockT.back(), v + k0 * n + k0 + kb, n, n - k0 - kb);
+      }
+    }
+  }
+
+  // factors columns k0..k0+kb-1: left half, its block reflector applied to
+  // the right half, then the right half
+  void _factorPanel(int k0, int kb) {
+    int m = qr.rows;
+    int n = qr.cols;
+    MatType *v = qr.values;
+    if (kb > 4) {
+      int half = kb / 2;
+      _factorPanel(k0, half);
+      _applyBlock(k0, half, _blockT(k0, half), v + k0 * n + k0 + half, n, kb - half);
+      _factorPanel(k0 + half, kb - half);
+      return;
+    }
+    MatType w[4];
+    for (int j = k0; j < k0 + kb; ++j) {
+      _reflector(j);
+      int width = k0 + kb - (j + 1);
+      if (width == 0 || tau[j] == 0) {
+        continue;
+      }
+      // apply H_j to the rest of the panel
+      std::fill(w, w + width, 0);
+      for (int r = j; r < m; ++r) {
+        MatType vr = r == j ? 1 : v[r * n + j];
+        for (int c = 0; c < width; ++c) {
+          w[c] += vr * v[r * n + j + 1 + c];
+        }
+      }
+      for (int r = j; r < m; ++r) {
+        MatType vr = tau[j] * (r == j ? 1 : v[r * n + j]);
+        for (int c = 0; c < width; ++c) {
+          v[r * n + j + 1 + c] -= vr * w[c];
+        }
+      }
+    }
+  }
+
+  // Householder reflector zeroing column j below the diagonal
+  void _reflector(int j) {
+    int m = qr.rows;
+    int n = qr.cols;
+    MatType *v = qr.values;
+    MatType alpha = v[j * n + j];
+    MatType sigma = 0;
+    for (int r = j + 1; r < m; ++r) {
+      sigma += v[r * n + j] * v[r * n + j];
+    }
+    if (sigma == 0) {
+      tau[j] = 0;
+      return;
     }
+    MatType norm = std::sqrt(alpha * alpha + sigma);
+    MatType beta = alpha <= 0 ? norm : -norm;
+    tau[j] = (beta - alpha) / beta;
+    MatType scale = 1 / (alpha - beta);
+    for (int r = j + 1; r < m; ++r) {
+      v[r * n + j] *= scale;
+    }
+    v[j * n + j] = beta;
   }
 
-  Mat(int rows, int cols) {
-    this->rows = rows;
-    this->cols = cols;
-    values = new MatType[rows * cols];
+  // V of reflectors k0..k0+kb-1 is read in place from qr: V1, its top
+  // kb x kb, is unit lower triangular with the ones and zeros implicit and
+  // is handled by small loops; V2, the rows below, is a plain block of qr
+  // and goes to gemm through the row stride.
+  MatType _v1(int k0, int r, int c) const {
+    return r < c ? 0 : r == c ? 1 : qr.values[(k0 + r) * qr.cols + k0 + c];
   }
 
-  static Mat<MatType> eye(int n) {
-    Mat<MatType> ret(n, n);
-    for (int i = 0; i < n; ++i) {
-      for (int j = 0; j < n; ++j) {
-        ret.set(i, j, i == j ? 1 : 0);
+  // T with H_k0 ... H_k0+kb-1 = I - V T V^T (LAPACK larft, forward columnwise):
+  // T[0:i, i] = -tau_i T[0:i, 0:i] V[:, 0:i]^T v_i, with V2^T V2 from one gemm
+  std::vector<MatType> _blockT(int k0, int kb) {
+    int n = qr.cols;
+    int below = qr.rows - k0 - kb;
+    const MatType *v2 = qr.values + (k0 + kb) * n + k0;
+    std::vector<MatType> vtv(kb * kb, 0);
+    if (below > 0) {
+      gemmAny<MatType>(kb, kb, below, 1, v2, 1, n, v2, n, 1, vtv.data(), kb, 1);
+    }
+    for (int c = 0; c < kb; ++c) {
+      for (int i = c + 1; i < kb; ++i) {
+        for (int r = i; r < kb; ++r) {
+          vtv[c * kb + i] += _v1(k0, r, c) * _v1(k0, r, i);
+        }
       }
     }
-    return ret;
+    std::vector<MatType> t(kb * kb, 0);
+    for (int i = 0; i < kb; ++i) {
+      for (int row = 0; row < i; ++row) {
+        MatType val = 0;
+        for (int c = row; c < i; ++c) {
+          val += t[row * kb + c] * vtv[c * kb + i];
+        }
+        t[row * kb + i] = -tau[k0 + i] * val;
+      }
+      t[i * kb + i] = tau[k0 + i];
+    }
+    return t;
   }
 
-  static Mat<MatType> eyeLike(Mat<MatType> &like) {
-    Mat<MatType> ret(like.rows, like.cols);
-    for (int i = 0; i < like.rows; ++i) {
-      for (int j = 0; j < like.cols; ++j) {
-        ret.set(i, j, i == j ? 1 : 0);
+  // C = (I - V T V^T)^T C = C - V (T^T (V^T C)), C being rows k0..m of a
+  // matrix with row stride ldc and `cols` columns
+  void _applyBlock(int k0, int kb, const std::vector<MatType> &t, MatType *c, int ldc, int cols) {
+    int n = qr.cols;
+    int below = qr.rows - k0 - kb;
+    const MatType *v2 = qr.values + (k0 + kb) * n + k0;
+    MatType *c2 = c + kb * ldc;
+    // W = V1^T C1 + V2^T C2
+    std::vector<MatType> w(kb * cols, 0);
+    for (int i = 0; i < kb; ++i) {
+      for (int r = i; r < kb; ++r) {
+        MatType vri = _v1(k0, r, i);
+        for (int j = 0; j < cols; ++j) {
+          w[i * cols + j] += vri * c[r * ldc + j];
+        }
       }
     }
-    return ret;
+    if (below > 0) {
+      gemmAny<MatType>(kb, cols, below, 1, v2, 1, n, c2, ldc, 1, w.data(), cols, 1);
+    }
+    std::vector<MatType> tw(kb * cols, 0);
+    gemmAny<MatType>(kb, cols, kb, 1, t.data(), 1, kb, w.data(), cols, 1, tw.data(), cols, 1);
+    // C1 -= V1 TW, C2 -= V2 TW
+    for (int r = 0; r < kb; ++r) {
+      for (int i = 0; i <= r; ++i) {
+        MatType vri = _v1(k0, r, i);
+        for (int j = 0; j < cols; ++j) {
+          c[r * ldc + j] -= vri * tw[i * cols + j];
+        }
+      }
+    }
+    if (below > 0) {
+      gemmAny<MatType>(below, cols, kb, -1, v2, n, 1, tw.data(), cols, 1, c2, ldc, 1);
+    }
   }
 
-  static Mat<MatType> zeros(int rows, int cols) {
-    Mat<MatType> ret(rows, cols);
-    for (int i = 0; i < rows; ++i) {
+  // least-squares solution of A x = b for every column of b, x is n x b.cols
+  Mat<MatType> solve(Mat<MatType> b) {
+    int n = qr.cols;
+    int cols = b.cols;
+    Mat<MatType> qtb(std::move(b));
+    qtb._detach();
+    for (int k0 = 0; k0 < n; k0 += qrBlockSize) {
+      int panel = k0 / qrBlockSize;
+      _applyBlock(k0, std::min(qrBlockSize, n - k0), blockT[panel], qtb.values + k0 * cols, cols, cols);
+    }
+    // R x = (Q^T b)[0:n]
+    Mat<MatType> x(n, cols);
+    const MatType *v = qr.values;
+    for (int i = n - 1; i >= 0; --i) {
       for (int j = 0; j < cols; ++j) {
-        ret.set(i, j, 0);
+        MatType val = qtb.get(i, j);
+        for (int k = i + 1; k < n; ++k) {
+          val -= v[i * n + k] * x.get(k, j);
+        }
+        x.set(i, j, val / v[i * n + i]);
       }
     }
-    return ret;
+    return x;
   }
 
-  static Mat<MatType> zerosLike(Mat<MatType> &like) {
-    return zeros(like.rows, like.cols);
+  // the n x n upper triangular factor
+  Mat<MatType> r() {
+    int n = qr.cols;
+    Mat<MatType> ret = Mat<MatType>::zeros(n, n);
+    for (int i = 0; i < n; ++i) {
+      for (int j = i; j < n; ++j) {
+        ret.set(i, j, qr.get(i, j));
+      }
+    }
+    return ret;
   }
+};
 
-  ~Mat() {
-    delete values;
-  }
+// Many independent small R x C problems stored interleaved, struct of arrays
+// style: every stored vector holds the same entry of `lanes` systems, so one
+// vector operation advances all of them. Entry (r, c) of system s is lane
+// s % lanes of blocks[s / lanes * R * C + r * C + c]. Padding lanes of the
+// last block are zero and their results are meaningless.
+// Up to 4x4, inv, det and solve run the closed forms of Mat<T, N, N> on
+// whole vectors. Larger systems are eliminated with partial pivoting chosen
+// per lane. A singular system gives inf or nan in its own lane only.
+// threads <= 0 uses every hardware thread.
+const int batchChunkBlocks = 256;
 
-  MatType get(int r, int c) const {
-    return *(values + c + r * cols);
-  }
+template<typename MatType, int R, int C>
+struct MatBatch {
+  static_assert(std::is_same<MatType, float>::value || std::is_same<MatType, double>::value,
+                "MatBatch needs float or double");
+  typedef typename GemmBlocking<MatType>::Vec Vec;
+  static constexpr int lanes = GemmBlocking<MatType>::VL;
 
-  MatType get(int idx) const {
-    return *(values + idx);
-  }
+  int count;
+  std::vector<Vec> blocks;
 
-  MatType set(int r, int c, MatType val) {
-    *(values + c + r * cols) = val;
-    return val;
-  }
+  explicit MatBatch(int count) : count(count), blocks((count + lanes - 1) / lanes * R * C) {}
 
-  MatType set(int idx, MatType val) {
-    *(values + idx) = val;
-    return val;
+  int blockCount() const {
+    return (int) blocks.size() / (R * C);
   }
 
-  void _map(std::function<MatType(MatType val)> mapper) {
-    for (int i = 0; i < rows * cols; ++i) {
-      set(i, mapper(get(i)));
-    }
+  MatType get(int s, int r, int c) const {
+    return blocks[s / lanes * R * C + r * C + c][s % lanes];
   }
 
-  Mat<MatType> map(std::function<MatType(MatType val)> mapper) {
-    Mat<MatType> copy(*this);
-    copy._map(mapper);
-    return copy;
+  void set(int s, int r, int c, MatType val) {
+    blocks[s / lanes * R * C + r * C + c][s % lanes] = val;
   }
 
-  void _mapRow(int row, std::function<MatType(MatType val)> mapper) {
-    for (int i = 0; i < cols; ++i) {
-      set(row, i, mapper(get(row, i)));
+  Mat<MatType, R, C> mat(int s) const {
+    Mat<MatType, R, C> ret;
+    for (int i = 0; i < R * C; ++i) {
+      ret.set(i, blocks[s / lanes * R * C + i][s % lanes]);
     }
+    return ret;
   }
 
-  void _mapCol(int col, std::function<MatType(MatType val)> mapper) {
-    for (int i = 0; i < cols; ++i) {
-      set(i, col, mapper(get(i, col)));
+  void setMat(int s, const Mat<MatType, R, C> &m) {
+    for (int i = 0; i < R * C; ++i) {
+      blocks[s / lanes * R * C + i][s % lanes] = m.get(i);
     }
   }
 
-  void _mapRow(int row, std::function<MatType(MatType val, int idx)> mapper) {
-    for (int i = 0; i < cols; ++i) {
-      set(row, i, mapper(get(row, i), i));
-    }
+  MatBatch<MatType, R, C> inv(int threads=1) const {
+    MatBatch<MatType, R, C> ret(*this);
+    ret._inv(threads);
+    return ret;
   }
 
-  void _mapCol(int col, std::function<MatType(MatType val, int idx)> mapper) {
-    for (int i = 0; i < cols; ++i) {
-      set(i, col, mapper(get(i, col), i));
-    }
+  // inverts every system in place
+  void _inv(int threads=1) {
+    static_assert(R == C, "inv() needs square systems");
+    _forBlocks(threads, [&](int b) {
+      Vec *a = &blocks[b * R * R];
+      if constexpr (R <= 4) {
+        Mat<Vec, R, R> m;
+        std::copy(a, a + R * R, m.values);
+        m = m.inv();
+        std::copy(m.values, m.values + R * R, a);
+      } else {
+        Vec work[R * R] = {};
+        std::copy(a, a + R * R, work);
+        std::fill(a, a + R * R, Vec{});
+        for (int i = 0; i < R; ++i) {
+          a[i * R + i] += 1;
+        }
+        Vec det;
+        _eliminate<R, true>(work, a, det);
+      }
+    });
   }
 
-  void _add(Mat &other) {
-    for (int i = 0; i < rows * cols; ++i) {
-      set(i, get(i) + other.get(i));
-    }
+  std::vector<MatType> det(int threads=1) const {
+    static_assert(R == C, "det() needs square systems");
+    std::vector<MatType> ret(blockCount() * lanes);
+    _forBlocks(threads, [&](int b) {
+      const Vec *a = &blocks[b * R * R];
+      Vec det;
+      if constexpr (R <= 4) {
+        Mat<Vec, R, R> m;
+        std::copy(a, a + R * R, m.values);
+        det = m.det();
+      } else {
+        Vec work[R * R] = {};
+        std::copy(a, a + R * R, work);
+        _eliminate<0, false>(work, nullptr, det);
+      }
+      for (int l = 0; l < lanes; ++l) {
+        ret[b * lanes + l] = det[l];
+      }
+    });
+    ret.resize(count);
+    return ret;
   }
 
-  Mat<MatType> add(Mat &other) {
-    Mat<MatType> copy(*this);
-    copy._add(other);
-    return copy;
+  // x with A x = b for every system and every column of its b
+  template<int K>
+  MatBatch<MatType, R, K> solve(const MatBatch<MatType, R, K> &b, int threads=1) const {
+    static_assert(R == C, "solve() needs square systems");
+    MatBatch<MatType, R, K> ret(b);
+    _forBlocks(threads, [&](int block) {
+      const Vec *a = &blocks[block * R * R];
+      Vec *x = &ret.blocks[block * R * K];
+      if constexpr (R <= 4) {
+        Mat<Vec, R, R> m;
+        Mat<Vec, R, K> rhs;
+        std::copy(a, a + R * R, m.values);
+        std::copy(x, x + R * K, rhs.values);
+        rhs = m.solve(rhs);
+        std::copy(rhs.values, rhs.values + R * K, x);
+      } else {
+        Vec work[R * R] = {};
+        std::copy(a, a + R * R, work);
+        Vec det;
+        _eliminate<K, true>(work, x, det);
+      }
+    });
+    return ret;
   }
 
-  Mat<MatType> mul(Mat &other) {
-    Mat<MatType> copy(rows, other.cols);
-    for (int i = 0; i < this->rows; ++i) {
-      for (int j = 0; j < other.cols; ++j) {
-        MatType val = 0;
-        for (int k = 0; k < this->cols; ++k) {
-          val += get(i, k) * other.get(k, j);
+  void _forBlocks(int threads, const std::function<void(int)> &task) const {
+    int chunks = (blockCount() + batchChunkBlocks - 1) / batchChunkBlocks;
+    parallelFor(chunks, threads > 0 ? threads : defaultThreads(), [&](int chunk) {
+      int end = std::min(blockCount(), (chunk + 1) * batchChunkBlocks);
+      for (int b = chunk * batchChunkBlocks; b < end; ++b) {
+        task(b);
+      }
+    });
+  }
+
+  // Gauss-Jordan elimination of one block of systems, a is R x R and rhs
+  // R x K. Pivot search and row swaps are branch free: lanes compare and
+  // select instead. With `above` the rows above the pivot are cleared too,
+  // leaving the solutions in rhs; without it only det is wanted.
+  template<int K, bool above>
+  static void _eliminate(Vec *a, Vec *rhs, Vec &det) {
+    det = Vec{} + 1;
+#pragma GCC unroll 8
+    for (int col = 0; col < R; ++col) {
+      Vec best = _abs(a[col * R + col]);
+      Vec pivot = Vec{} + col;
+      for (int i = col + 1; i < R; ++i) {
+        Vec val = _abs(a[i * R + col]);
+        auto better = val > best;
+        best = better ? val : best;
+        pivot = better ? Vec{} + i : pivot;
+      }
+      for (int i = col + 1; i < R; ++i) {
+        auto swap = pivot == i;
+        for (int j = col; j < R; ++j) {
+          Vec top = a[col * R + j];
+          Vec row = a[i * R + j];
+          a[col * R + j] = swap ? row : top;
+          a[i * R + j] = swap ? top : row;
+        }
+        for (int j = 0; j < K; ++j) {
+          Vec top = rhs[col * K + j];
+          Vec row = rhs[i * K + j];
+          rhs[col * K + j] = swap ? row : top;
+          rhs[i * K + j] = swap ? top : row;
+        }
+        det = swap ? -det : det;
+      }
+      Vec diag = a[col * R + col];
+      det *= diag;
+      Vec scale = 1 / diag;
+      for (int j = col + 1; j < R; ++j) {
+        a[col * R + j] *= scale;
+      }
+      for (int j = 0; j < K; ++j) {
+        rhs[col * K + j] *= scale;
+      }
+      for (int i = above ? 0 : col + 1; i < R; ++i) {
+        if (i == col) {
+          continue;
+        }
+        Vec f = a[i * R + col];
+        for (int j = col + 1; j < R; ++j) {
+          a[i * R + j] -= f * a[col * R + j];
+        }
+        for (int j = 0; j < K; ++j) {
+          rhs[i * K + j] -= f * rhs[col * K + j];
         }
-        copy.set(i, j, val);
       }
     }
-    return copy;
   }
 
-  void _swapRows(int a, int b) {
-    MatType tmp;
-    for (int i = 0; i < cols; ++i) {
-      tmp = get(a, i);
-      set(a, i, get(b, i));
-      set(b, i, tmp);
-    }
+  static Vec _abs(Vec x) {
+    return x < 0 ? -x : x;
   }
+};
 
-  void _swapRows(int a, int b, Mat &attached) {
-    _swapRows(a, b);
-    attached._swapRows(a, b);
+template<typename MatType>
+Mat<MatType> randomMat(int rows, int cols, std::mt19937 &gen) {
+  std::uniform_real_distribution<double> dist(-1, 1);
+  Mat<MatType> ret(rows, cols);
+  for (int i = 0; i < rows * cols; ++i) {
+    ret.set(i, dist(gen));
   }
+  return ret;
+}
 
-  int maxRowInCol(int col, std::function<MatType(MatType)> preprocessor=[](MatType x) { return x; }, int maxRow=-1, int minRow=0) {
-    if (maxRow < 0) {
-      maxRow = rows;
-    }
-    int r = minRow;
-    for (int i = minRow; i < maxRow; ++i) {
-      MatType c1 = preprocessor(get(i, col));
-      MatType c2 = preprocessor(get(r, col));
-      if (c1 > c2) {
-        r = i;
+double secondsOf(const std::function<void()> &run) {
+  auto start = std::chrono::steady_clock::now();
+  run();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<typename MatType>
+void benchMul(int n, std::mt19937 &gen) {
+  Mat<MatType> a = randomMat<MatType>(n, n, gen);
+  Mat<MatType> b = randomMat<MatType>(n, n, gen);
+  Mat<MatType> naive(n, n);
+  double naiveSeconds = secondsOf([&] {
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) {
+        MatType val = 0;
+        for (int k = 0; k < n; ++k) {
+          val += a.get(i, k) * b.get(k, j);
+        }
+        naive.set(i, j, val);
       }
     }
-    return r;
+  });
+  Mat<MatType> product(0, 0);
+  double seconds = secondsOf([&] { product = a.mul(b); });
+  MatType error = 0;
+  for (int i = 0; i < n * n; ++i) {
+    error = std::max(error, std::abs(product.get(i) - naive.get(i)));
   }
+  double gflop = 2.0 * n * n * n / 1e9;
+  std::cout << (sizeof(MatType) == 4 ? "float " : "double") << " mul " << n << "x" << n
+            << ": naive " << gflop / naiveSeconds << " GFLOP/s, packed " << gflop / seconds
+            << " GFLOP/s, max diff " << error << std::endl;
+}
 
-  int minRowInCol(int col, std::function<MatType(MatType)> preprocessor=[](MatType x) { return x; }, int maxRow=-1, int minRow=0) {
-    if (maxRow < 0) {
-      maxRow = rows;
-    }
-    int r = minRow;
-    for (int i = minRow; i < maxRow; ++i) {
-      MatType c1 = preprocessor(get(i, col));
-      MatType c2 = preprocessor(get(r, col));
-      if (c1 < c2) {
-        r = i;
-      }
-    }
-    return r;
+template<typename MatType>
+void benchParallelMul(int n, std::mt19937 &gen) {
+  Mat<MatType> a = randomMat<MatType>(n, n, gen);
+  Mat<MatType> b = randomMat<MatType>(n, n, gen);
+  Mat<MatType> serial = a.mul(b);
+  double gflop = 2.0 * n * n * n / 1e9;
+  for (int threads = 1; threads <= defaultThreads(); threads *= 2) {
+    Mat<MatType> product(0, 0);
+    double seconds = secondsOf([&] { product = a.mul(b, threads); });
+    std::cout << (sizeof(MatType) == 4 ? "float " : "double") << " mul " << n << "x" << n
+              << " on " << threads << " threads: " << gflop / seconds << " GFLOP/s, "
+              << (product.equals(serial) ? "same as serial" : "DIFFERS from serial") << std::endl;
   }
+}
+
+// buffers allocated by one pipeline, once through named intermediates (every
+// step copies, as all of them did before Mat could be moved) and once chained,
+// where map, add, transpose and inv reuse the buffer of the temporary they get
+void benchAllocations(std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(64, 48, gen);
+  Mat<double> b = randomMat<double>(48, 64, gen);
+  auto scale = [](double x) { return 2 * x; };
+
+  long long start = Mat<double>::allocations;
+  Mat<double> t = a.transpose();
+  Mat<double> scaled = t.map(scale);
+  Mat<double> sum = scaled.add(b);
+  Mat<double> square = sum.mul(a);
+  Mat<double> inverse = square.inv();
+  Mat<double> named = inverse.mul(b);
+  long long namedAllocations = Mat<double>::allocations - start;
+
+  start = Mat<double>::allocations;
+  Mat<double> chained = a.transpose().map(scale).add(b).mul(a).inv().mul(b);
+  long long chainedAllocations = Mat<double>::allocations - start;
 
-  int maxColInRow(int row, std::function<MatType(MatType)> preprocessor=[](MatType x) { return x; }, int maxCol=-1, int minCol=0) {
-    if (maxCol < 0) {
-      maxCol = cols;
+  std::cout << "allocations of ((2 A^T + B) A)^-1 B: " << namedAllocations << " through named steps, "
+            << chainedAllocations << " chained, " << (named.equals(chained) ? "same result" : "results DIFFER")
+            << std::endl;
+}
+
+// (a + b) mapped and scaled: eager methods make one pass over memory per
+// step, the lazy expression a single one into an existing matrix
+void benchFused(int n, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(n, n, gen);
+  Mat<double> b = randomMat<double>(n, n, gen);
+  Mat<double> eager(0, 0);
+  Mat<double> fused(n, n);
+  auto f = [](double x) { return x * x + 1; };
+  auto half = [](double x) { return 0.5 * x; };
+  double eagerSeconds = secondsOf([&] { eager = a.add(b).map(f).map(half); });
+  double fusedSeconds = secondsOf([&] { fused = lazy(a).add(b).map(f).scale(0.5); });
+  std::cout << "((a + b)^2 + 1) / 2 " << n << "x" << n << ": eager " << eagerSeconds << " s, fused "
+            << fusedSeconds << " s, " << (fused.equals(eager) ? "same result" : "results DIFFER") << std::endl;
+}
+
+// elementwise map through a std::function (one indirect call per element)
+// and through the inlined template overload
+void benchMap(int n, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(n, n, gen);
+  Mat<double> b(a);
+  std::function<double(double)> wrapped = [](double x) { return 3 * x + 1; };
+  double wrappedSeconds = secondsOf([&] { a._map(wrapped); });
+  double inlinedSeconds = secondsOf([&] { b._map([](double x) { return 3 * x + 1; }); });
+  std::cout << "_map " << n << "x" << n << ": std::function " << wrappedSeconds << " s, template "
+            << inlinedSeconds << " s, " << (a.equals(b) ? "same result" : "results DIFFER") << std::endl;
+}
+
+// a chain of small products and inverses, x = (a x)^-1, with Mat<double>
+// and with Mat<double, N, N>
+template<int N>
+void benchFixed(int count, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(N, N, gen).add(Mat<double>::eye(N).map([](double x) { return N * x; }));
+  Mat<double, N, N> fixedA(a);
+  Mat<double> x = Mat<double>::eye(N);
+  Mat<double, N, N> fixedX = Mat<double, N, N>::eye();
+  double dynamicSeconds = secondsOf([&] {
+    for (int i = 0; i < count; ++i) {
+      x = a.mul(x).inv();
     }
-    int c = 0;
-    for (int i = minCol; i < maxCol; ++i) {
-      MatType c1 = preprocessor(get(row, i));
-      MatType c2 = preprocessor(get(c, i));
-      if (c1 > c2) {
-        c = i;
-      }
+  });
+  double fixedSeconds = secondsOf([&] {
+    for (int i = 0; i < count; ++i) {
+      fixedX = fixedA.mul(fixedX).inv();
     }
-    return c;
+  });
+  double diff = 0;
+  for (int i = 0; i < N * N; ++i) {
+    diff = std::max(diff, std::abs(x.get(i) - fixedX.get(i)));
   }
+  std::cout << N << "x" << N << " mul + inv: Mat<double> " << count / dynamicSeconds / 1e6 << " M/s, Mat<double, "
+            << N << ", " << N << "> " << count / fixedSeconds / 1e6 << " M/s, max diff " << diff << std::endl;
+}
 
-  int minColInRow(int row, std::function<MatType(MatType)> preprocessor=[](MatType x) { return x; }, int maxCol=-1, int minCol=0) {
-    if (maxCol < 0) {
-      maxCol = cols;
+// count N x N inverses: Mat<double>::inv() per system, Mat<double, N, N>
+// per system, and MatBatch in place on one and on all threads
+template<int N>
+void benchBatch(int count, std::mt19937 &gen) {
+  MatBatch<double, N, N> batch(count);
+  std::vector<Mat<double, N, N>> fixed;
+  std::vector<Mat<double>> dynamic;
+  for (int s = 0; s < count; ++s) {
+    dynamic.push_back(randomMat<double>(N, N, gen));
+    fixed.push_back(Mat<double, N, N>(dynamic.back()));
+    batch.setMat(s, fixed.back());
+  }
+  std::vector<Mat<double>> dynamicInverses;
+  std::vector<Mat<double, N, N>> fixedInverses(count);
+  double dynamicSeconds = secondsOf([&] {
+    for (auto &m : dynamic) {
+      dynamicInverses.push_back(m.inv());
+    }
+  });
+  double fixedSeconds = secondsOf([&] {
+    for (int s = 0; s < count; ++s) {
+      fixedInverses[s] = fixed[s].inv();
     }
-    int c = 0;
-    for (int i = minCol; i < maxCol; ++i) {
-      MatType c1 = preprocessor(get(row, i));
-      MatType c2 = preprocessor(get(c, i));
-      if (c1 < c2) {
-        c = i;
+  });
+  MatBatch<double, N, N> inverses(batch);
+  double batchSeconds = secondsOf([&] { inverses._inv(); });
+  inverses = batch;
+  double threadedSeconds = secondsOf([&] { inverses._inv(0); });
+  double diff = 0;
+  for (int s = 0; s < count; ++s) {
+    Mat<double, N, N> &expected = fixedInverses[s];
+    for (int i = 0; i < N; ++i) {
+      for (int j = 0; j < N; ++j) {
+        diff = std::max(diff, std::abs(inverses.get(s, i, j) - expected.get(i, j)) / (1 + std::abs(expected.get(i, j))));
       }
     }
-    return c;
   }
+  std::cout << count << " " << N << "x" << N << " inverses: Mat<double> " << dynamicSeconds << " s, Mat<double, "
+            << N << ", " << N << "> " << fixedSeconds << " s, MatBatch " << batchSeconds << " s, on "
+            << defaultThreads() << " threads " << threadedSeconds << " s, max rel diff " << diff << std::endl;
+}
 
-  void _transpose() {
-    for (int i = 0; i < rows; ++i) {
-      for (int j = 0; j < cols; ++j) {
-        if (i > j) {
-          MatType val = get(i, j);
-          set(i, j, get(j, i));
-          set(j, i, val);
-        }
+// work on an n/2 x n/2 window of an n x n matrix: copied out, changed and
+// copied back, against the same through a view
+void benchViews(int n, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(n, n, gen);
+  Mat<double> b = randomMat<double>(n / 2, n / 2, gen);
+  Mat<double> copied(a);
+  int m = n / 2;
+  double copySeconds = secondsOf([&] {
+    Mat<double> window(m, m);
+    for (int i = 0; i < m; ++i) {
+      for (int j = 0; j < m; ++j) {
+        window.set(i, j, copied.get(m / 2 + i, m / 2 + j));
       }
     }
-  }
+    window._add(b);
+    window._map([](double x) { return x * x; });
+    for (int i = 0; i < m; ++i) {
+      for (int j = 0; j < m; ++j) {
+        copied.set(m / 2 + i, m / 2 + j, window.get(i, j));
+      }
+    }
+  });
+  double viewSeconds = secondsOf([&] {
+    MatView<double> window = a.block(m / 2, m / 2, m, m);
+    window._add(b.view());
+    window._map([](double x) { return x * x; });
+  });
+  std::cout << "add and map on a " << m << "x" << m << " window of " << n << "x" << n << ": copies "
+            << copySeconds << " s, view " << viewSeconds << " s, " << (a.equals(copied) ? "same result" : "results DIFFER")
+            << std::endl;
+}
 
-  Mat<MatType> transpose() {
-    Mat<MatType> copy(*this);
-    copy._transpose();
-    return copy;
-  }
+// copies of an n x n matrix (100 MB at n = 3620) with and without
+// copy-on-write, and the first write to a copy-on-write copy
+void benchCow(int n, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(n, n, gen);
+  double plainSeconds = secondsOf([&] { Mat<double> copy(a); });
+  a.cow();
+  double cowSeconds = secondsOf([&] { Mat<double> copy(a); });
+  Mat<double> copy(a);
+  double writeSeconds = secondsOf([&] { copy.set(0, 0, 1); });
+  std::cout << "copy " << n << "x" << n << ": plain " << plainSeconds << " s, copy-on-write " << cowSeconds
+            << " s, its first write " << writeSeconds << " s" << std::endl;
+}
 
-  void _triangulate(Mat &attached) {
-    for (int currentRow = 0; currentRow < rows; ++currentRow) {
-      for (int subRow = currentRow + 1; subRow < rows; ++subRow) {
-        // int mric = maxRowInCol(currentRow, [](MatType x) { return x > 0 ? x : -x; }, rows, currentRow);
-        int mric = maxRowInCol(currentRow, [&](MatType x) {
-          MatType numerator = get(subRow, currentRow);
-          MatType res = abs(1 / (numerator / x - 1));
-          return std::isnan(res) ? 1 : res;
-        }, rows, currentRow);
-        _swapRows(currentRow, mric, attached);
-        MatType multiplier = get(subRow, currentRow) / get(currentRow, currentRow);
-        for (int i = currentRow; i < cols; ++i) {
-          set(subRow, i, get(subRow, i) - multiplier * get(currentRow, i));
-        }
-        attached._mapRow(subRow, [&](MatType val, int i) { return val - multiplier * attached.get(currentRow, i); });
-      }
+// a loop of small temporaries with buffers from the heap and from a pool
+void benchPool(int n, int count, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(n, n, gen);
+  Mat<double> b = randomMat<double>(n, n, gen);
+  volatile double sink = 0;
+  auto loop = [&] {
+    for (int i = 0; i < count; ++i) {
+      sink = sink + a.add(b).get(0);
     }
-  }
+  };
+  double heapSeconds = secondsOf(loop);
+  MatPoolAllocator pool;
+  MatAllocator *previous = matAllocator().exchange(&pool);
+  double poolSeconds = secondsOf(loop);
+  matAllocator() = previous;
+  std::cout << count << " a + b, " << n << "x" << n << ": heap " << heapSeconds << " s, pool "
+            << poolSeconds << " s, " << pool.hits << " hits, " << pool.misses << " misses, "
+            << (reinterpret_cast<uintptr_t>(a.values) % matAlignment == 0 ? "aligned" : "NOT aligned") << std::endl;
+}
 
-  void _diagonalize(Mat &attached) {
-    _triangulate(attached);
-    for (int currentRow = rows - 1; currentRow >= 0; --currentRow) {
-      for (int subRow = 0; subRow < currentRow; ++subRow) {
-        MatType multiplier = get(subRow, currentRow) / get(currentRow, currentRow);
-        set(subRow, currentRow, get(subRow, currentRow) - multiplier * get(currentRow, currentRow));
-        attached._mapRow(subRow, [&](MatType val, int i) { return val - multiplier * attached.get(currentRow, i); });
+// The pivot rule _triangulate had before it chose each pivot once: a search
+// over the column through a std::function for every (currentRow, subRow)
+// pair, kept as the reference for benchTriangulate.
+void triangulatePerPairPivot(Mat<double> &a) {
+  for (int currentRow = 0; currentRow < a.rows; ++currentRow) {
+    for (int subRow = currentRow + 1; subRow < a.rows; ++subRow) {
+      std::function<double(double)> preprocessor = [&](double x) {
+        double numerator = a.get(subRow, currentRow);
+        double res = std::abs(1 / (numerator / x - 1));
+        return std::isnan(res) ? 1 : res;
+      };
+      int mric = a.maxRowInCol(currentRow, preprocessor, a.rows, currentRow);
+      a._swapRows(currentRow, mric);
+      double multiplier = a.get(subRow, currentRow) / a.get(currentRow, currentRow);
+      for (int i = currentRow; i < a.cols; ++i) {
+        a.set(subRow, i, a.get(subRow, i) - multiplier * a.get(currentRow, i));
       }
     }
   }
+}
 
-  void _toOnes(Mat &attached) {
-    _diagonalize(attached);
-    for (int i = 0; i < rows; ++i) {
-      attached._mapRow(i, [&](MatType val) { return val / get(i, i); });
-      set(i, i, 1);
-    }
+// forward elimination of an n x n matrix by _triangulate and, when
+// withReference is set, by the per-pair pivot rule it replaced
+void benchTriangulate(int n, bool withReference, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(n, n, gen);
+  Mat<double> b(a);
+  Mat<double> dummy(n, 0);
+  double seconds = secondsOf([&] { a._triangulate(dummy); });
+  std::cout << "_triangulate " << n << "x" << n << ": " << seconds << " s";
+  if (withReference) {
+    double referenceSeconds = secondsOf([&] { triangulatePerPairPivot(b); });
+    std::cout << ", per-pair pivot search " << referenceSeconds << " s, " << referenceSeconds / seconds << "x";
   }
+  std::cout << std::endl;
+}
 
-  Mat<MatType> inv() {
-    Mat<MatType> ret = eyeLike(*this);
-    Mat<MatType> self(*this);
-    self._toOnes(ret);
-    return ret;
+// factoring an n x n symmetric positive definite matrix by LLT, LDLT and LU
+void benchCholesky(int n, std::mt19937 &gen) {
+  Mat<double> r = randomMat<double>(n, n, gen);
+  Mat<double> a = r.gram();
+  for (int i = 0; i < n; ++i) {
+    a.set(i, i, a.get(i, i) + n);
   }
+  double lltSeconds = secondsOf([&] { LLT<double> llt(a); });
+  double ldltSeconds = secondsOf([&] { LDLT<double> ldlt(a); });
+  double luSeconds = secondsOf([&] { LU<double> lu(a); });
+  std::cout << "factor SPD " << n << "x" << n << ": LLT " << lltSeconds << " s, LDLT " << ldltSeconds
+            << " s, LU " << luSeconds << " s" << std::endl;
+}
 
-  MatType det() {
-    // TODO: switch sign on rows swap
-    Mat<MatType> copy(*this);
-    Mat<MatType> dummy(rows, 0);
-    copy._diagonalize(dummy);
-    MatType ret = 1;
-    for (int i = 0; i < rows; ++i) {
-      ret *= copy.get(i, i);
-    }
-    return ret;
-  }
+// A^T A of an m x n matrix, by gram() and by the general tmul()
+void benchGram(int m, int n, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(m, n, gen);
+  Mat<double> general(0, 0);
+  double tmulSeconds = secondsOf([&] { general = a.tmul(a); });
+  Mat<double> symmetric(0, 0);
+  double gramSeconds = secondsOf([&] { symmetric = a.gram(); });
+  std::cout << "A^T A " << m << "x" << n << ": tmul " << tmulSeconds << " s, gram " << gramSeconds << " s, "
+            << (symmetric.equals(general) ? "same result" : "results DIFFER") << std::endl;
+}
 
-  bool equals(Mat &other) {
-    if (rows != other.rows || cols != other.cols) {
-      return false;
-    }
-    for (int i = 0; i < rows * cols; ++i) {
-      if (get(i) != other.get(i)) {
-        return false;
-      }
-    }
-    return true;
+// loading an n x n matrix: parsed from text by input(), read from a
+// binary file by loadMat and mapped by mapMat
+void benchFile(int n, std::mt19937 &gen) {
+  Mat<double> a = randomMat<double>(n, n, gen);
+  std::stringstream text;
+  text << std::setprecision(17) << n << " " << n;
+  for (int i = 0; i < n * n; ++i) {
+    text << " " << a.get(i);
   }
+  std::string path = (std::filesystem::temp_directory_path() / "stz-bench.mat").string();
+  saveMat(path, a);
+  Mat<double> parsed(0, 0);
+  double textSeconds = secondsOf([&] { parsed.input(text); });
+  Mat<double> loaded(0, 0);
+  double loadSeconds = secondsOf([&] { loaded = loadMat<double>(path); });
+  Mat<double> mapped(0, 0);
+  double mapSeconds = secondsOf([&] { mapped = mapMat<double>(path).mat(); });
+  std::cout << "load " << n << "x" << n << ": text " << textSeconds << " s, loadMat " << loadSeconds
+            << " s, mapMat " << mapSeconds << " s, "
+            << (parsed.equals(a) && loaded.equals(a) && mapped.equals(a) ? "same result" : "results DIFFER") << std::endl;
+  std::remove(path.c_str());
+}
 
-  bool isnan() {
-    for (int i = 0; i < rows * cols; ++i) {
-      MatType val = *(values + i);
-      if (std::isnan(val)) {
-        return true;
-      }
-    }
-    return false;
+void bench() {
+  std::mt19937 gen(42);
+  benchGram(100000, 50, gen);
+  benchGram(20000, 200, gen);
+  benchGram(4000, 1000, gen);
+  benchFile(2048, gen);
+  benchPool(8, 1000000, gen);
+  benchPool(64, 100000, gen);
+  benchCow(3620, gen);
+  benchViews(4096, gen);
+  benchBatch<4>(65536, gen);
+  benchBatch<6>(65536, gen);
+  benchFixed<3>(1000000, gen);
+  benchFixed<4>(1000000, gen);
+  benchAllocations(gen);
+  benchFused(4096, gen);
+  benchMap(3200, gen);
+  for (int n : {128, 256, 512, 1024}) {
+    benchMul<float>(n, gen);
+    benchMul<double>(n, gen);
   }
-
-  bool isinf() {
-    for (int i = 0; i < rows * cols; ++i) {
-      MatType val = *(values + i);
-      if (std::isinf(val)) {
-        return true;
-      }
-    }
-    return false;
+  // the reference scans a column for every pair of rows, at 2000x2000 that
+  // alone takes about 40 s
+  for (int n : {500, 1000, 1500}) {
+    benchCholesky(n, gen);
   }
-
-  void print(std::ostream &to, std::string name="") {
-    if (!name.empty()) {
-      to << name << " =" << std::endl;
-    }
-    to << std::setprecision(3);
-    for (int r = 0; r < rows; ++r) {
-      to << "| ";
-      for (int c = 0; c < cols; ++c) {
-        to << get(r, c) << "\t";
-      }
-      to << "|\n";
-    }
-    to << std::endl;
+  benchTriangulate(500, true, gen);
+  benchTriangulate(1000, true, gen);
+  benchTriangulate(2000, false, gen);
+  {
+    Mat<double> a = randomMat<double>(100000, 50, gen);
+    Mat<double> b = randomMat<double>(100000, 4, gen);
+    double inverse = secondsOf([&] {
+      Mat<double> ata = a.tmul(a);
+      Mat<double> atb = a.tmul(b);
+      ata.inv().mul(atb);
+    });
+    double normal = secondsOf([&] { leastSquares(a, b); });
+    double householder = secondsOf([&] { QR<double>(a).solve(b); });
+    std::cout << "least squares 100000x50: inv " << inverse << " s, Cholesky " << normal
+              << " s, QR " << householder << " s" << std::endl;
   }
+  benchParallelMul<float>(2048, gen);
+  benchParallelMul<double>(2048, gen);
+}
 
-  void input(std::istream &from) {
-    from >> rows;
-    from >> cols;
-    for (int i = 0; i < rows; ++i) {
-      for (int j = 0; j < cols; ++i) {
-        MatType val;
-        from >> val;
-        set(i, j, val);
-      }
-    }
+int main(int argc, char *argv[]) {
+  if (argc > 1 && std::string(argv[1]) == "--bench") {
+    bench();
+    return 0;
   }
-};
 
-int main(int argc, char *argv[]) {
   double AData[4][4] = {
     {10, 6, 2, 0},
     {5, 1, -2, 4},
@@ -387,18 +3442,22 @@ int main(int argc, char *argv[]) {
 
   // Ax = b
   // A^T Ax = A^T b
-  // x = (A^T A)^-1 A^T b
+  // x = (A^T A)^-1 A^T b, solved by Cholesky of A^T A in leastSquares
 
-  // auto aT = a.transpose();
-  // auto x = aT.mul(a).inv().mul(aT).mul(b);
+  // auto x = leastSquares(a, b);
 
-  auto x = a.inv().mul(b);
+  LU<double> lu(a);
+  auto x = lu.solve(b);
 
   a.print(std::cout, "A");
-  a.inv().print(std::cout, "A^-1");
+  lu.inv().print(std::cout, "A^-1");
   b.print(std::cout, "b");
   x.print(std::cout, "x");
 
+  int sign;
+  double logDet = a.logAbsDet(&sign);
+  std::cout << "det A = " << a.det() << " = " << sign << " * exp(" << logDet << ")" << std::endl;
+
   // a._toOnes(b);
   // b.print(std::cout);
 